@@ -0,0 +1,4 @@
+; FLASH4 single platform build: N8VEM SBC bank switching only
+BANKSWITCH_FIXED = 1
+USE_N8VEM_SBC = 1
+    .include "bankswitch.s"
@@ -0,0 +1,4 @@
+; FLASH4 single platform build: P112 B/P BIOS bank switching only
+BANKSWITCH_FIXED = 1
+USE_P112 = 1
+    .include "bankswitch.s"
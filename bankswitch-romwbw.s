@@ -0,0 +1,4 @@
+; FLASH4 single platform build: RomWBW v2.6+ bank switching only
+BANKSWITCH_FIXED = 1
+USE_ROMWBW_26 = 1
+    .include "bankswitch.s"
@@ -0,0 +1,4 @@
+; FLASH4 single platform build: UNA BIOS bank switching only
+BANKSWITCH_FIXED = 1
+USE_UNABIOS = 1
+    .include "bankswitch.s"
@@ -9,20 +9,61 @@
 #define BANKSWITCH_ROMWBW_26    3 /* v2.6 and later */
 #define BANKSWITCH_N8VEM_SBC    4
 
+/* T-states per byte taken by the unrolled inner loops in bankswitch.s,
+   leaving out the per-call and per-chunk overheads; the host build uses
+   these to model the CPU time of each benchmark scenario */
+#define BANKSWITCH_TSTATES_COPY         17 /* LDI x16: 16 + 10/16 */
+#define BANKSWITCH_TSTATES_VERIFY       38 /* LD A,(DE) CPI JR INC DE x8: 36 + 10/8 */
+#define BANKSWITCH_TSTATES_CONSTANT     25 /* CPI JR x8: 23 + 10/8 */
+#define BANKSWITCH_TSTATES_SKIP         33 /* CPI JR JP over a run of 0xFF while programming */
+#define BANKSWITCH_CPU_MHZ               8 /* CPU clock the interrupt limit is worked out for */
+
+/* Time the block operations hold interrupts off per byte, used to turn the
+   limit given to bankswitch_set_irq_limit() into chunk sizes. The read figure
+   is the verify loop, the slowest of the read loops; the write figure allows
+   for the 20us byte program time of the slower chips plus our loop. Slower
+   CPUs will hold interrupts off for proportionally longer. */
+#define BANKSWITCH_READ_US_PER_BYTE     ((BANKSWITCH_TSTATES_VERIFY + BANKSWITCH_CPU_MHZ - 1) / BANKSWITCH_CPU_MHZ)
+#define BANKSWITCH_WRITE_US_PER_BYTE    30
+#define BANKSWITCH_DEFAULT_IRQ_LIMIT  1000 /* microseconds */
+
+/* RomWBW numbers its RAM banks from 0x80, so RAM appears to the block
+   functions above the largest flash ROM they can address */
+#define BANKSWITCH_RAM_BANK0          0x80
+#define BANKSWITCH_RAM_BASE           ((unsigned long)BANKSWITCH_RAM_BANK0 << 15)
+
+/* the P112 EEPROM is accessed with 3 memory wait states (DCNTL bits 7-6) */
+#define BANKSWITCH_P112_ROM_WAITS     0xC0
+
+/* RomWBW HBIOS version (as returned by SYSVER) from which block reads and
+   copies to RAM use the HBIOS inter-bank copy rather than our own LDIR */
+#define BANKSWITCH_BIOS_COPY_VERSION  0x3000
+
 void init_bankswitch(unsigned char method);
+void bankswitch_set_irq_limit(unsigned int us); /* 0 = no limit */
 void bankswitch_check_irq_flag(void);
 unsigned int bankswitch_get_current_bank(void) CALLING;
 unsigned int bankswitch_get_rom_bank_count(void) CALLING; /* only implemented for RomWBW 2.6+ */
+unsigned int bankswitch_get_bios_bank(void) CALLING;      /* only implemented for RomWBW 2.6+ */
+unsigned int bankswitch_get_bios_version(void) CALLING;   /* only implemented for RomWBW 2.6+ */
 
 void flashrom_chip_write_bankswitch(unsigned long address, unsigned char value) CALLING;
 unsigned char flashrom_chip_read_bankswitch(unsigned long address) CALLING;
 void flashrom_block_read_bankswitch(unsigned long address, unsigned char *buffer, unsigned int length) CALLING;
 void flashrom_block_write_bankswitch(unsigned long address, unsigned char *buffer, unsigned int length) CALLING;
 bool flashrom_block_verify_bankswitch(unsigned long address, unsigned char *buffer, unsigned int length) CALLING;
+bool flashrom_block_verify_constant_bankswitch(unsigned long address, unsigned char value, unsigned int length) CALLING;
+void ram_block_write_bankswitch(unsigned long address, unsigned char *buffer, unsigned int length) CALLING; /* banked RAM */
 
 extern unsigned int default_mem_bank;
 extern unsigned char bank_switch_method;
 extern unsigned int rom_bank_count;
 extern bool irq_enabled_flag;
+extern unsigned int bankswitch_read_chunk;  /* bytes per interrupt-off chunk, 0 = no limit */
+extern unsigned int bankswitch_write_chunk;
+extern bool bankswitch_bios_copy;           /* block reads use the BIOS inter-bank copy */
+extern unsigned long bankswitch_bios_bytes; /* bytes copied by the BIOS */
+extern unsigned long bankswitch_ldir_bytes; /* bytes copied by switching banks ourselves */
+extern unsigned char bankswitch_rom_waits;  /* P112: DCNTL memory wait state bits while the ROM is mapped */
 
 #endif
@@ -2,16 +2,26 @@
 
     .globl _bankswitch_get_current_bank
     .globl _bankswitch_get_rom_bank_count
+    .globl _bankswitch_get_bios_bank
+    .globl _bankswitch_get_bios_version
+    .globl _bankswitch_bios_copy
+    .globl _bankswitch_bios_bytes
+    .globl _bankswitch_ldir_bytes
     .globl _flashrom_chip_read_bankswitch
     .globl _flashrom_chip_write_bankswitch
     .globl _flashrom_block_read_bankswitch
     .globl _flashrom_block_write_bankswitch
     .globl _flashrom_block_verify_bankswitch
+    .globl _flashrom_block_verify_constant_bankswitch
+    .globl _ram_block_write_bankswitch
     .globl _default_mem_bank
     .globl _bank_switch_method
     .globl _una_entry_vector
     .globl _bankswitch_check_irq_flag
     .globl _irq_enabled_flag
+    .globl _bankswitch_read_chunk
+    .globl _bankswitch_write_chunk
+    .globl _bankswitch_rom_waits
 
 ; RomWBW entry vectors
 ROMWBW_OLD_SETBNK  .equ 0xFC06  ; prior to v2.6
@@ -19,6 +29,10 @@ ROMWBW_OLD_GETBNK  .equ 0xFC09  ; prior to v2.6
 ROMWBW_SETBNK      .equ 0xFFF3  ; v2.6 and later (function vector)
 ROMWBW_CURBNK      .equ 0xFFE0  ; v2.6 and later (byte variable)
 ROMWBW_MEMINFO     .equ 0xF8F1  ; v2.6 and later
+ROMWBW_BNKINFO     .equ 0xF8F2  ; v2.6 and later
+ROMWBW_SYSVER      .equ 0xF100  ; HBIOS version
+ROMWBW_SYSSETCPY   .equ 0xF4    ; B register - set up an inter-bank copy
+ROMWBW_SYSBNKCPY   .equ 0xF5    ; B register - perform an inter-bank copy
 
 ; UNA BIOS banked memory functions
 UNABIOS_ENTRY      .equ 0x08 ; entry vector
@@ -38,8 +52,22 @@ N8VEM_MPCL_ROM     .equ 0x7C ; IO address of ROM memory pager configuration latc
     .area _CODE
     .z180
 
+    ; A single platform build of FLASH4 assembles this file through one of
+    ; the bankswitch-*.s wrappers, which define BANKSWITCH_FIXED and the
+    ; USE_ symbol for the one method required. The universal build includes
+    ; every method and dispatches on _bank_switch_method at runtime.
+    .ifndef BANKSWITCH_FIXED
+USE_ROMWBW_OLD = 1
+USE_UNABIOS = 1
+USE_P112 = 1
+USE_ROMWBW_26 = 1
+USE_N8VEM_SBC = 1
+    .endif
+
     ; load the page in register HL into the banked region (lower 32K)
+    ; RomWBW and N8VEM SBC use only L, UNA BIOS uses all of HL
 loadbank:
+    .ifndef BANKSWITCH_FIXED
     ld a, (_bank_switch_method)
     or a
     jr z, loadbank_romwbw_old
@@ -53,19 +81,27 @@ loadbank:
     jr z, loadbank_n8vem_sbc
     ; well, this is unexpected
     ret
+    .endif
+    .ifdef USE_N8VEM_SBC
 loadbank_n8vem_sbc:
     ld a, l
     out (N8VEM_MPCL_ROM), a
     out (N8VEM_MPCL_RAM), a
     ret
+    .endif
+    .ifdef USE_ROMWBW_OLD
 loadbank_romwbw_old:
     ld a, l
     call #ROMWBW_OLD_SETBNK
     ret
+    .endif
+    .ifdef USE_ROMWBW_26
 loadbank_romwbw_26:
     ld a, l
     call #ROMWBW_SETBNK
     ret
+    .endif
+    .ifdef USE_UNABIOS
 loadbank_unabios:
     ; This is slightly tricky. Normally we'd enter UNA via the RST 8 call,
     ; but we can't do this as we're going to replace the lower part of memory
@@ -78,6 +114,8 @@ loadbank_unabios:
     jp (hl)                     ; simulate call to entry vector
 loadbank_una_return:
     ret
+    .endif
+    .ifdef USE_P112
 loadbank_p112:
     ; map in the EEPROM if HL==0, else unmap it
     ld a, h
@@ -89,9 +127,13 @@ map_p112_rom:
     in0 a, (P112_SCR)
     and a, #0xf7        ; enable EEPROM
     out0 (P112_SCR), a
+    push hl
     in0 a, (P112_DCNTL)
-    or #0xc0            ; set 3 memory wait states
+    and #0x3f
+    ld hl, #_bankswitch_rom_waits
+    or (hl)             ; set the memory wait states, normally 3
     out0 (P112_DCNTL), a
+    pop hl
     ret
 unmap_p112_rom:
     out0 (P112_BBR), l
@@ -100,11 +142,46 @@ unmap_p112_rom:
     out0 (P112_SCR), a
     out0 (P112_DCNTL), h
     ret
+    .endif
+
+_bankswitch_get_bios_bank:
+    .ifdef USE_ROMWBW_26
+    .ifndef BANKSWITCH_FIXED
+    ld a, (_bank_switch_method)
+    cp #3               ; romwbw 2.6+?
+    jr nz, retzero      ; return 0 if not
+    .endif
+    ld bc, #ROMWBW_BNKINFO ; SYSGET BNKINFO
+    rst 8               ; call into RomWBW
+    or a                ; A=0?
+    jr nz, retzero      ; something went wrong
+    ld h, #0
+    ld l, d             ; return BIOS bank ID in HL
+    ret
+    .endif
+
+_bankswitch_get_bios_version:
+    .ifdef USE_ROMWBW_26
+    .ifndef BANKSWITCH_FIXED
+    ld a, (_bank_switch_method)
+    cp #3               ; romwbw 2.6+?
+    jr nz, retzero      ; return 0 if not
+    .endif
+    ld bc, #ROMWBW_SYSVER
+    rst 8               ; call into RomWBW
+    or a                ; A=0?
+    jr nz, retzero      ; something went wrong
+    ex de, hl           ; return version in HL
+    ret
+    .endif
 
 _bankswitch_get_rom_bank_count:
+    .ifdef USE_ROMWBW_26
+    .ifndef BANKSWITCH_FIXED
     ld a, (_bank_switch_method)
     cp #3               ; romwbw 2.6+?
     jr nz, retzero      ; return 0 if not
+    .endif
     ld bc, #ROMWBW_MEMINFO ; SYSGET MEMINFO
     rst 8               ; call into RomWBW
     or a                ; A=0?
@@ -112,9 +189,14 @@ _bankswitch_get_rom_bank_count:
     ld h, #0
     ld l, d             ; return number of ROM banks in HL
     ret
+    .endif
+retzero:
+    ld hl, #0
+    ret
 
     ; return the currently loaded page number
 _bankswitch_get_current_bank:
+    .ifndef BANKSWITCH_FIXED
     ld a, (_bank_switch_method)
     or a
     jr z, getbank_romwbw_old
@@ -127,23 +209,29 @@ _bankswitch_get_current_bank:
     dec a
     jr z, getbank_n8vem_sbc
     ; well, this is unexpected
-retzero:
-    ld hl, #0
-    ret
+    jr retzero
+    .endif
+    .ifdef USE_N8VEM_SBC
 getbank_n8vem_sbc:
     ld hl, #0x0080      ; we assume that it's the first page of RAM
     ret
+    .endif
+    .ifdef USE_ROMWBW_OLD
 getbank_romwbw_old:
     call #ROMWBW_OLD_GETBNK
     ; returns page number in A
     ld h, #0
     ld l, a
     ret
+    .endif
+    .ifdef USE_ROMWBW_26
 getbank_romwbw_26:
     ld a, (ROMWBW_CURBNK)
     ld h, #0
     ld l, a
     ret
+    .endif
+    .ifdef USE_UNABIOS
 getbank_unabios:
     ld bc, #(UNABIOS_BANK_GET << 8 | UNABIOS_BANKEDMEM)
     ld hl, #getbank_una_return
@@ -154,35 +242,44 @@ getbank_una_return:
     ; returns page number in DE
     ex de, hl
     ret
+    .endif
+    .ifdef USE_P112
 getbank_p112:
     in0 h, (P112_DCNTL)
     in0 l, (P112_BBR)
     ret
+    .endif
 
 selectaddr:
     ; compute bank number, disable interrupts, select it
     ; 32-bit address is at sp+4 through sp+7
-    ; The code below is limited to 256 x 32KB banks = 8MB
-    ; eg for flash address = 0x654321:
+    ; The bank number is 16 bits wide; loadbank uses as many bits as the
+    ; BIOS or hardware supports (see access_max_size() in flash4.c)
+    ; eg for flash address = 0x01654321:
     ; mem addr: SP+4 SP+5 SP+6 SP+7
-    ; contents:  21   43   65   00
-    ; bank number = address >> 15    = 0xCA   -- data in SP+6 (7 bits), SP+5 (1 bit)
+    ; contents:  21   43   65   01
+    ; bank number = address >> 15    = 0x02CA -- data in SP+7, SP+6 and top bit of SP+5
     ; bank offset = address & 0x7FFF = 0x4321 -- data in SP+5 (7 bits), SP+4 (8 bits)
 
     ; first compute bank number
-    ld hl,#6
-    add hl,sp       ; HL is now SP+6
-    ld a, (hl)      ; 7 bits we want are in here
-    add a, a        ; shift left one place
-    dec hl          ; HL is now SP+5
-    bit 7, (hl)     ; test top bit
-    jr z, bankready
-    or #1           ; set low bit if required
-bankready:
-    ; now A contains desired bank number -- let's select that bank!
+    ld hl,#5
+    add hl,sp       ; HL is now SP+5
+    ld a, (hl)
+    rla             ; top bit of SP+5 -> carry
+    inc hl          ; HL is now SP+6
+    ld a, (hl)
+    rla             ; shift carry in; low byte of bank number
+    ld e, a
+    inc hl          ; HL is now SP+7
+    ld a, (hl)
+    rla             ; shift carry (top bit of SP+6) in; high byte of bank number
+    ld d, a
+    dec hl
+    dec hl          ; HL is now SP+5 again
+    ; now DE contains desired bank number -- let's select that bank!
     push hl         ; stash this, we'll need it in a moment
-    ld h, #0        ; zero high byte
-    ld l, a         ; bank number now in HL
+    ex de, hl       ; bank number now in HL
+    ld (curbank), hl ; irqwindow needs it to select the bank again
     di              ; disable interrupts; the vector or ISR may be in banked memory
     call loadbank   ; switch memory bank
     pop hl          ; HL is now SP+5 again
@@ -209,6 +306,168 @@ _flashrom_chip_write_bankswitch:
     ld (de), a      ; write to flash memory 
     jr putback
 
+    ; Block operations are split into chunks of at most (chunklimit) bytes when
+    ; interrupts were enabled on entry, so that interrupts are not held off for
+    ; longer than the user allows (see bankswitch_set_irq_limit). Between chunks
+    ; our memory is put back and interrupts are briefly enabled. The inner loops
+    ; are unchanged; only the byte count in BC is cut up.
+
+    ; on entry BC = bytes left in this operation
+    ; returns BC = bytes in the next chunk, the rest is left in (remain)
+    ; preserves DE, HL
+splitchunk:
+    push hl
+    push de
+    ld a, (_irq_enabled_flag)
+    bit 0, a
+    jr z, wholeblock ; interrupts were off anyway
+    ld hl, (chunklimit)
+    ld a, h
+    or l
+    jr z, wholeblock ; no limit set
+    ex de, hl       ; DE = limit
+    ld h, b
+    ld l, c         ; HL = bytes left
+    or a
+    sbc hl, de      ; HL = bytes left - limit
+    jr c, wholeblock
+    jr z, wholeblock
+    ld (remain), hl
+    ld b, d
+    ld c, e         ; BC = limit
+    pop de
+    pop hl
+    ret
+wholeblock:
+    ld hl, #0
+    ld (remain), hl
+    pop de
+    pop hl
+    ret
+
+    ; called when a chunk is complete
+    ; returns Z if the operation is complete, else opens an interrupt window
+    ; and returns NZ with BC = bytes in the next chunk
+    ; preserves DE, HL
+nextchunk:
+    push hl
+    ld hl, (remain)
+    ld b, h
+    ld c, l
+    pop hl
+    ld a, b
+    or c
+    ret z
+    call irqwindow
+    call splitchunk
+    ld a, b
+    or c            ; BC is not zero, so this returns NZ
+    ret
+
+    ; put our memory back, allow pending interrupts to be serviced,
+    ; then select the flash bank again; preserves BC, DE, HL
+irqwindow:
+    push bc
+    push de
+    push hl
+    ld hl, (_default_mem_bank)
+    call loadbank
+    ei
+    nop             ; an interrupt is accepted after the instruction following ei
+    di
+    ld hl, (curbank)
+    call loadbank
+    pop hl
+    pop de
+    pop bc
+    ret
+
+    ; add BC to the 32-bit byte counter at HL; preserves BC, DE
+tally:
+    ld a, (hl)
+    add a, c
+    ld (hl), a
+    inc hl
+    ld a, (hl)
+    adc a, b
+    ld (hl), a
+    inc hl
+    ld a, (hl)
+    adc a, #0
+    ld (hl), a
+    inc hl
+    ld a, (hl)
+    adc a, #0
+    ld (hl), a
+    ret
+
+    ; count the bytes of a block copy done by bank switching
+    ; on entry BC = length; preserves BC, DE, HL
+tallyldir:
+    push hl
+    ld hl, #_bankswitch_ldir_bytes
+    call tally
+    pop hl
+    ret
+
+    .ifdef USE_ROMWBW_26
+    ; Copy between a bank and our buffer with the RomWBW HBIOS inter-bank
+    ; copy, which leaves interrupts and the BIOS bank bookkeeping to the BIOS.
+    ; on entry A = 0 to copy from the bank to the buffer, else the other way
+    ; stack is as for the block functions, plus our return address
+bioscopy:
+    push ix
+    ld ix, #0
+    add ix, sp
+    ; 0(ix) saved IX, 2(ix) our return, 4(ix) caller's return,
+    ; 6(ix)..9(ix) address, 10(ix) buffer, 12(ix) length
+    ld c, a             ; keep the direction
+    ld l, 6(ix)
+    ld a, 7(ix)
+    and #0x7F
+    ld h, a             ; HL = offset within the bank
+    ld e, 10(ix)
+    ld d, 11(ix)        ; DE = buffer
+    ld a, c
+    or a
+    jr z, biosaddr
+    ex de, hl           ; copying into the bank: the buffer is the source
+biosaddr:
+    push hl             ; source
+    push de             ; destination
+    ld l, 12(ix)
+    ld h, 13(ix)        ; HL = length
+    push hl
+    ld a, 7(ix)
+    rla                 ; top bit of the offset -> carry
+    ld a, 8(ix)
+    rla
+    ld e, a             ; E = bank holding the address; RomWBW bank IDs are 8 bits
+    ld a, (_default_mem_bank)
+    ld d, a             ; D = our bank
+    ld a, c
+    or a
+    jr z, biosbanks
+    ld a, d             ; copying into the bank: swap source and destination
+    ld d, e
+    ld e, a
+biosbanks:
+    ; the BIOS may not preserve IX, so everything it needs is on the stack
+    ld b, #ROMWBW_SYSSETCPY ; D = destination bank, E = source bank, HL = length
+    rst 8
+    pop bc              ; length
+    pop de              ; destination
+    pop hl              ; source
+    push bc
+    ld b, #ROMWBW_SYSBNKCPY ; HL = source, DE = destination
+    rst 8
+    pop bc
+    ld hl, #_bankswitch_bios_bytes
+    call tally
+    pop ix
+    ret
+    .endif
+
 targetlength:
     ex de, hl       ; banked flash address -> hl
     push ix
@@ -221,10 +480,70 @@ targetlength:
     pop ix
     ret
 
+    ; The inner loops below are unrolled; the T-states per byte they take are
+    ; given in bankswitch.h, where the interrupt chunk sizes are worked out.
+    ; Each loop first deals with the odd bytes one at a time, until the count
+    ; is a multiple of the unrolled length. Block lengths are normally a
+    ; multiple of 128 bytes, so in practice the fast loop does all the work.
+
+    ; copy BC bytes from HL to DE, like LDIR; returns with BC = 0
+    ; LDI unrolled x16: 16 + 10/16 T-states per byte (LDIR takes 21)
+copyblock:
+    ld a, c
+    and #15
+    jr z, copy16
+    push bc
+    ld c, a
+    ld b, #0
+    ldir            ; the odd bytes
+    pop bc
+    ld a, c
+    and #0xF0
+    ld c, a
+copy16:
+    ld a, b
+    or c
+    ret z
+copy16next:
+    ldi
+    ldi
+    ldi
+    ldi
+    ldi
+    ldi
+    ldi
+    ldi
+    ldi
+    ldi
+    ldi
+    ldi
+    ldi
+    ldi
+    ldi
+    ldi
+    jp pe, copy16next ; P/V is set until BC reaches zero
+    ret
+
 _flashrom_block_read_bankswitch:
+    .ifdef USE_ROMWBW_26
+    ld a, (_bankswitch_bios_copy)
+    or a
+    jr z, ldirread
+    xor a               ; from the bank to the buffer
+    call bioscopy
+    ret
+ldirread:
+    .endif
+    ld hl, (_bankswitch_read_chunk)
+    ld (chunklimit), hl
     call selectaddr
     call targetlength
-    ldir            ; copy copy copy
+    call tallyldir
+    call splitchunk
+readchunk:
+    call copyblock  ; copy copy copy
+    call nextchunk
+    jr nz, readchunk
     ; fall through to putback
 putback:
     ; restore original memory bank, restore interrupt flag
@@ -240,33 +559,142 @@ putback:
     ret    ; return
 
 _flashrom_block_verify_bankswitch:
+    ld hl, (_bankswitch_read_chunk)
+    ld (chunklimit), hl
     call selectaddr
     call targetlength
+    call splitchunk
     ; DE = source address in RAM (pointer into buffer)
     ; HL = destination address in flash (pointer into banked memory)
-    ; BC = byte counter (# bytes remaining to program)
+    ; BC = byte counter (# bytes remaining in this chunk)
 cmpnext:
+    ld a, c
+    and #7
+    jr z, cmp8
+cmp1:
+    ld a, (de)      ; the odd bytes
+    cpi             ; compare A with (HL), HL++, BC--
+    jr nz, cmpfail
+    inc de
+    ld a, c
+    and #7
+    jr nz, cmp1
+cmp8:
     ld a, b
     or c
-    jr z, cmpok
+    jr z, cmpchunk
+cmp8next:
+    ; 36 T-states per byte plus 10 per 8 bytes (the simple loop took 66)
     ld a, (de)
-    cp (hl)
+    cpi
     jr nz, cmpfail
     inc de
-    inc hl
-    dec bc
-    jr cmpnext
+    ld a, (de)
+    cpi
+    jr nz, cmpfail
+    inc de
+    ld a, (de)
+    cpi
+    jr nz, cmpfail
+    inc de
+    ld a, (de)
+    cpi
+    jr nz, cmpfail
+    inc de
+    ld a, (de)
+    cpi
+    jr nz, cmpfail
+    inc de
+    ld a, (de)
+    cpi
+    jr nz, cmpfail
+    inc de
+    ld a, (de)
+    cpi
+    jr nz, cmpfail
+    inc de
+    ld a, (de)
+    cpi
+    jr nz, cmpfail
+    inc de
+    jp pe, cmp8next ; P/V is set until BC reaches zero
+cmpchunk:
+    call nextchunk
+    jr nz, cmpnext
 cmpok:
     ld l, #1        ; return true
-    jr putback
+    jp putback
 cmpfail:
     ld l, #0        ; return false
-    jr putback
+    jp putback
 
+_flashrom_block_verify_constant_bankswitch:
+    ld hl, (_bankswitch_read_chunk)
+    ld (chunklimit), hl
+    call selectaddr
+    ; HL = SP+4 (address), value is at SP+8, length at SP+9, SP+10
+    inc hl
+    inc hl
+    inc hl
+    inc hl
+    ld a, (hl)      ; value -> a
+    inc hl
+    ld c, (hl)      ; length -> bc
+    inc hl
+    ld b, (hl)
+    ex de, hl       ; banked flash address -> hl
+    ld e, a         ; E = value we expect
+    call splitchunk
+    ; A = value we expect
+    ; HL = address in flash (pointer into banked memory)
+    ; BC = byte counter (# bytes remaining in this chunk)
+cstchunk:
+    ld a, c
+    and #7
+    ld a, e
+    jr z, cst8
+cst1:
+    cpi             ; the odd bytes; compare A with (HL), HL++, BC--
+    jr nz, cmpfail
+    ld a, c
+    and #7
+    ld a, e
+    jr nz, cst1
+cst8:
+    ld a, b
+    or c
+    ld a, e
+    jr z, cstdone
+cst8next:
+    ; 23 T-states per byte plus 10 per 8 bytes (the simple loop took 33)
+    cpi
+    jr nz, cmpfail
+    cpi
+    jr nz, cmpfail
+    cpi
+    jr nz, cmpfail
+    cpi
+    jr nz, cmpfail
+    cpi
+    jr nz, cmpfail
+    cpi
+    jr nz, cmpfail
+    cpi
+    jr nz, cmpfail
+    cpi
+    jr nz, cmpfail
+    jp pe, cst8next ; P/V is set until BC reaches zero
+cstdone:
+    call nextchunk
+    jr nz, cstchunk
+    jr cmpok
 
 _flashrom_block_write_bankswitch:
+    ld hl, (_bankswitch_write_chunk)
+    ld (chunklimit), hl
     call selectaddr
     call targetlength
+    call splitchunk
 writenext:
     ; program a range of bytes in flash;
     ; DE = source address in RAM (pointer into buffer)
@@ -289,16 +717,36 @@ writenext:
 nextbyte:
     dec bc
     inc de
+    ld a, b          ; are there any bytes left to write?
+    or c
+    jr z, writewait  ; if this was the last byte, complete normally
 
     ; check if the next byte is 0xff -- we can skip it (0xff = erased)
     ld a, (de)
     inc a
     jr nz, writewait ; only 0xff + 1 = 0
-    ld a, b          ; but are there any bytes left to write?
-    or c
-    jr z, writewait  ; if this was the last byte, complete normally
-    inc hl           ; data sheet does not indicate we must read status from the same address
-    jr nextbyte      ; okay, we can safely skip this byte!
+
+    ; Skip the whole run of 0xff bytes: scan the buffer with CPI (33 T-states
+    ; per byte, the byte at a time loop took 63) then move the flash pointer
+    ; on by the same amount. The data sheet does not indicate we must read
+    ; status from the same address we programmed.
+    push bc          ; bytes left, including the run
+    ex de, hl        ; HL = buffer, DE = flash
+    dec a            ; A = 0xff
+skipnext:
+    cpi              ; compare A with (HL), HL++, BC--
+    jr nz, skipend
+    jp pe, skipnext  ; P/V is set until BC reaches zero
+    jr skipped       ; 0xff all the way to the end
+skipend:
+    dec hl           ; back to the byte to program
+    inc bc
+skipped:
+    ex (sp), hl      ; HL = bytes left before the run, buffer on the stack
+    or a
+    sbc hl, bc       ; HL = length of the run
+    add hl, de       ; HL = flash address after the run
+    pop de           ; DE = buffer
 
     ; wait for programming to complete
 writewait:
@@ -315,7 +763,35 @@ writewait:
     ld a, b
     or c
     jr nz, writenext
-    jr putback
+    call nextchunk   ; the chip is idle now, so we can let interrupts in
+    jr nz, writenext
+    jp putback
+
+    ; copy a buffer into banked RAM; the same as a block read with the
+    ; direction of the copy reversed
+_ram_block_write_bankswitch:
+    .ifdef USE_ROMWBW_26
+    ld a, (_bankswitch_bios_copy)
+    or a
+    jr z, ldirram
+    inc a               ; from the buffer to the bank
+    call bioscopy
+    ret
+ldirram:
+    .endif
+    ld hl, (_bankswitch_read_chunk)
+    ld (chunklimit), hl
+    call selectaddr
+    call targetlength
+    call tallyldir
+    call splitchunk
+ramchunk:
+    ex de, hl       ; HL = buffer, DE = banked RAM
+    call copyblock
+    ex de, hl       ; nextchunk expects them the other way round
+    call nextchunk
+    jr nz, ramchunk
+    jp putback
 
 ; determine if IRQs are enabled -- based on Z80 Family Q&A
 ; page 3-131 http://z80.info/zip/ZilogProductSpecsDatabook129-143.pdf
@@ -342,3 +818,6 @@ irqdone:
 
     .area _DATA
 _irq_enabled_flag:      .ds 1
+curbank:                .ds 2 ; flash bank selected by selectaddr
+chunklimit:             .ds 2 ; maximum bytes per chunk in this operation, 0 = no limit
+remain:                 .ds 2 ; bytes left after the current chunk
@@ -7,6 +7,32 @@ unsigned int default_mem_bank;
 unsigned char bank_switch_method = 0xff;
 unsigned int una_entry_vector = 0;
 unsigned int rom_bank_count = 0;
+unsigned int bankswitch_read_chunk = 0;
+unsigned int bankswitch_write_chunk = 0;
+bool bankswitch_bios_copy = false;
+unsigned long bankswitch_bios_bytes = 0;
+unsigned long bankswitch_ldir_bytes = 0;
+unsigned char bankswitch_rom_waits = BANKSWITCH_P112_ROM_WAITS;
+
+/* chunks are a power of two in size so that they line up with the
+   records and subsectors the block operations are given */
+static unsigned int irq_chunk_bytes(unsigned int us, unsigned int us_per_byte)
+{
+    unsigned int bytes, chunk;
+
+    if(us == 0)
+        return 0; /* no limit */
+    bytes = us / us_per_byte;
+    for(chunk = 1; chunk <= bytes / 2; chunk <<= 1);
+
+    return chunk; /* always make some progress, even if the limit is very short */
+}
+
+void bankswitch_set_irq_limit(unsigned int us)
+{
+    bankswitch_read_chunk = irq_chunk_bytes(us, BANKSWITCH_READ_US_PER_BYTE);
+    bankswitch_write_chunk = irq_chunk_bytes(us, BANKSWITCH_WRITE_US_PER_BYTE);
+}
 
 void init_bankswitch(unsigned char method)
 {
@@ -23,4 +49,8 @@ void init_bankswitch(unsigned char method)
 
     default_mem_bank = bankswitch_get_current_bank();
     rom_bank_count = bankswitch_get_rom_bank_count();
+
+    /* newer RomWBW copies between banks for us, keeping its own bank
+       bookkeeping and interrupt handling intact */
+    bankswitch_bios_copy = (bankswitch_get_bios_version() >= BANKSWITCH_BIOS_COPY_VERSION);
 }
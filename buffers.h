@@ -10,4 +10,15 @@
 extern unsigned char filebuffer[CPM_BLOCK_SIZE * FILEBUFFER_BLOCKS];
 extern unsigned char rombuffer[CPM_BLOCK_SIZE]; /* used by Z180 DMA as temporary holding space */
 
+#define SECTOR_MAP_BYTES 512 /* one bit per sector, enough for 4096 sectors */
+
+extern unsigned char sector_map[SECTOR_MAP_BYTES]; /* sectors which differ from the image file */
+extern unsigned char checkpointbuffer[CPM_BLOCK_SIZE]; /* one record of the WRITE checkpoint file */
+extern unsigned char image_map[SECTOR_MAP_BYTES]; /* sectors covered by a hex image file */
+extern unsigned char hexbuffer[CPM_BLOCK_SIZE]; /* one record of a hex image file */
+
+#define PACKETBUFFER_SIZE 1024 /* largest XMODEM packet */
+
+extern unsigned char packetbuffer[PACKETBUFFER_SIZE]; /* one packet of a serial transfer */
+
 #endif
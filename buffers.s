@@ -2,6 +2,11 @@
 
         .globl _filebuffer
         .globl _rombuffer
+        .globl _sector_map
+        .globl _checkpointbuffer
+        .globl _image_map
+        .globl _hexbuffer
+        .globl _packetbuffer
 
 ; sdcc doesn't put buffers into _BSS so we end up huge chunks of nothing in our executable.
 ; we have to fix this up by hand.
@@ -12,3 +17,8 @@
         ; keep these in sync with the definitions in buffers.h
 _filebuffer: .ds (128 * 32)
 _rombuffer:  .ds 128
+_sector_map: .ds 512
+_checkpointbuffer: .ds 128
+_image_map:  .ds 512
+_hexbuffer:  .ds 128
+_packetbuffer: .ds 1024
@@ -5,5 +5,7 @@
 #include "calling.h"
 
 bool detect_z180_cpu(void) CALLING;
+unsigned char z180_in0(unsigned char port) CALLING;              /* read an internal register */
+void z180_out0(unsigned char port, unsigned char value) CALLING; /* write an internal register */
 
 #endif
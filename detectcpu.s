@@ -1,6 +1,8 @@
     .module detectcpu
 
     .globl _detect_z180_cpu
+    .globl _z180_in0
+    .globl _z180_out0
 
     .area _CODE
 
@@ -15,3 +17,23 @@ _detect_z180_cpu:
     ret nz                ; Z80 -> return 0
     inc l                 ; Z180 -> return 1
     ret
+
+    ; Z180 internal registers: the port is given in full as they are only
+    ; decoded when A8-A15 are low; IN0/OUT0 would fix the port at assembly
+_z180_in0:
+    ld hl, #2
+    add hl, sp
+    ld c, (hl)            ; port
+    ld b, #0
+    in l, (c)
+    ret
+
+_z180_out0:
+    ld hl, #2
+    add hl, sp
+    ld c, (hl)            ; port
+    inc hl
+    ld a, (hl)            ; value
+    ld b, #0
+    out (c), a
+    ret
@@ -6,6 +6,7 @@
     Compile with: gcc -O2 -Wall flash030.c -o flash030
 */
 
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
@@ -15,6 +16,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #define FLASHROM_PHYSICAL_BASE   0xFFF00000  /* Location in the physical address space */
@@ -24,11 +26,18 @@ typedef enum {
     ACTION_UNKNOWN, 
     ACTION_READ, 
     ACTION_WRITE, 
-    ACTION_VERIFY 
+    ACTION_VERIFY,
+    ACTION_BLANK,
+    ACTION_ERASE
 } action_t;
 
 static action_t action = ACTION_UNKNOWN;
 bool allow_partial=false;
+bool plan_only=false;
+bool full_verify=false;
+bool fill_gaps=false;      /* treat sectors not in a hex file as blank */
+bool *image_covered=NULL;  /* sectors covered by a hex file; NULL for binary images */
+FILE *plan_output;
 int mem_fd;
 unsigned char volatile *flashrom_mapping;
 
@@ -38,6 +47,10 @@ typedef struct {
     unsigned int sector_size;  /* in bytes */
     unsigned int sector_count;
     unsigned char strategy;
+    /* typical timings from the data sheets, used to plan and estimate writes */
+    unsigned int sector_erase_ms; /* sector erase (ST_PROGRAM_SECTORS: sector program cycle) */
+    unsigned int chip_erase_ms;   /* whole chip erase */
+    unsigned char program_us;     /* single byte program */
 } flashrom_chip_t; 
 
 /* the strategy flags describe quirks for programming particular chips */
@@ -46,35 +59,43 @@ typedef struct {
 #define ST_ERASE_CHIP           (0x02) /* bit 1: erase whole chip (sector_count must be exactly 1) instead of individual sectors */
 
 static flashrom_chip_t flashrom_chips[] = {
-    { 0x0120, "29F010",        16384,    8, ST_NORMAL },
-    { 0x01A4, "29F040",        65536,    8, ST_NORMAL },
-    { 0x1F04, "AT49F001NT",   131072,    1, ST_ERASE_CHIP }, /* multiple but unequal sized sectors */
-    { 0x1F05, "AT49F001N",    131072,    1, ST_ERASE_CHIP }, /* multiple but unequal sized sectors */
-    { 0x1F07, "AT49F002N",    262144,    1, ST_ERASE_CHIP }, /* multiple but unequal sized sectors */
-    { 0x1F08, "AT49F002NT",   262144,    1, ST_ERASE_CHIP }, /* multiple but unequal sized sectors */
-    { 0x1F13, "AT49F040",     524288,    1, ST_ERASE_CHIP }, /* single sector device */
-    { 0x1F5D, "AT29C512",        128,  512, ST_PROGRAM_SECTORS },
-    { 0x1FA4, "AT29C040",        256, 2048, ST_PROGRAM_SECTORS },
-    { 0x1FD5, "AT29C010",        128, 1024, ST_PROGRAM_SECTORS },
-    { 0x1FDA, "AT29C020",        256, 1024, ST_PROGRAM_SECTORS },
-    { 0x2020, "M29F010",       16384,    8, ST_NORMAL },
-    { 0x20E2, "M29F040",       65536,    8, ST_NORMAL },
-    { 0x37A4, "A29010B",       32768,    4, ST_NORMAL },
-    { 0x3786, "A29040B",       65536,    8, ST_NORMAL },
-    { 0xBFD5, "39VF010",        4096,   32, ST_NORMAL },
-    { 0xBFD6, "39VF020",        4096,   64, ST_NORMAL },
-    { 0xBFD7, "39VF040",        4096,  128, ST_NORMAL },
-    { 0xBFB5, "39SF010",        4096,   32, ST_NORMAL },
-    { 0xBFB6, "39SF020",        4096,   64, ST_NORMAL },
-    { 0xBFB7, "39SF040",        4096,  128, ST_NORMAL },     /* recommended device */
-    { 0xC2A4, "MX29F040",      65536,    8, ST_NORMAL },
+    { 0x0120, "29F010",        16384,    8, ST_NORMAL,          1000,  8000,  7 },
+    { 0x01A4, "29F040",        65536,    8, ST_NORMAL,          1000,  8000,  7 },
+    { 0x1F04, "AT49F001NT",   131072,    1, ST_ERASE_CHIP,     10000, 10000, 30 }, /* multiple but unequal sized sectors */
+    { 0x1F05, "AT49F001N",    131072,    1, ST_ERASE_CHIP,     10000, 10000, 30 }, /* multiple but unequal sized sectors */
+    { 0x1F07, "AT49F002N",    262144,    1, ST_ERASE_CHIP,     10000, 10000, 30 }, /* multiple but unequal sized sectors */
+    { 0x1F08, "AT49F002NT",   262144,    1, ST_ERASE_CHIP,     10000, 10000, 30 }, /* multiple but unequal sized sectors */
+    { 0x1F13, "AT49F040",     524288,    1, ST_ERASE_CHIP,     10000, 10000, 30 }, /* single sector device */
+    { 0x1F5D, "AT29C512",        128,  512, ST_PROGRAM_SECTORS,   10,     0,  0 },
+    { 0x1FA4, "AT29C040",        256, 2048, ST_PROGRAM_SECTORS,   10,     0,  0 },
+    { 0x1FD5, "AT29C010",        128, 1024, ST_PROGRAM_SECTORS,   10,     0,  0 },
+    { 0x1FDA, "AT29C020",        256, 1024, ST_PROGRAM_SECTORS,   10,     0,  0 },
+    { 0x2020, "M29F010",       16384,    8, ST_NORMAL,          1000,  8000, 10 },
+    { 0x20E2, "M29F040",       65536,    8, ST_NORMAL,          1000,  8000, 10 },
+    { 0x37A4, "A29010B",       32768,    4, ST_NORMAL,          1000,  4000,  7 },
+    { 0x3786, "A29040B",       65536,    8, ST_NORMAL,          1000,  8000,  7 },
+    { 0xBFD5, "39VF010",        4096,   32, ST_NORMAL,            18,    70, 14 },
+    { 0xBFD6, "39VF020",        4096,   64, ST_NORMAL,            18,    70, 14 },
+    { 0xBFD7, "39VF040",        4096,  128, ST_NORMAL,            18,    70, 14 },
+    { 0xBFB5, "39SF010",        4096,   32, ST_NORMAL,            18,    70, 14 },
+    { 0xBFB6, "39SF020",        4096,   64, ST_NORMAL,            18,    70, 14 },
+    { 0xBFB7, "39SF040",        4096,  128, ST_NORMAL,            18,    70, 14 }, /* recommended device */
+    { 0xC2A4, "MX29F040",      65536,    8, ST_NORMAL,          1000,  4000,  7 },
     /* terminate the list */
-    { 0x0000, NULL,            0,    0, 0 }
+    { 0x0000, NULL,            0,    0, 0,                     0,     0,  0 }
 };
 
+#define WRITE_ATTEMPTS 3 /* times we try to program a sector before giving up */
+
 static flashrom_chip_t *flashrom_type = NULL;
 static unsigned int flashrom_size; /* bytes */
 
+/* region of the flash we operate on, set with --offset and --length */
+static unsigned int region_offset = 0; /* bytes */
+static unsigned int region_length = 0; /* bytes, 0 means up to the end of the flash */
+static unsigned int region_first;      /* first sector in the region */
+static unsigned int region_end;        /* sector after the last sector in the region */
+
 unsigned char flashrom_chip_read(unsigned long address)
 {
     return flashrom_mapping[address];
@@ -219,66 +240,244 @@ void flashrom_read(int img_fd)
     unsigned long offset;
     ssize_t w;
 
-    offset = 0;
-    while(offset < flashrom_size){
-        printf("\rRead %d/%dKB ", (int)(offset >> 10), (int)(flashrom_size >> 10));
+    size_t chunk;
+
+    offset = region_offset;
+    while(offset < region_offset + region_length){
+        printf("\rRead %d/%dKB ", (int)((offset - region_offset) >> 10), (int)(region_length >> 10));
         fflush(stdout);
-        w = write(img_fd, (char*)&flashrom_mapping[offset], READ_CHUNK_SIZE);
-        if(w != READ_CHUNK_SIZE){
+        chunk = region_offset + region_length - offset;
+        if(chunk > READ_CHUNK_SIZE)
+            chunk = READ_CHUNK_SIZE;
+        w = write(img_fd, (char*)&flashrom_mapping[offset], chunk);
+        if(w != chunk){
             printf("write() failed: %s\n", strerror(errno));
             _exit(1);
         }
-        offset += READ_CHUNK_SIZE;
+        offset += chunk;
     }
 
     printf("\rRead complete.       \n");
 }
 
+unsigned int count_programmed_bytes(const unsigned char *buffer, unsigned int length)
+{
+    unsigned int count = 0;
+
+    /* bytes containing 0xFF are left erased and need not be programmed */
+    while(length--)
+        if(*(buffer++) != 0xFF)
+            count++;
+
+    return count;
+}
+
+/* sectors a hex file does not cover are left alone, unless --fill-gaps is given */
+bool sector_in_image(unsigned int sector)
+{
+    return !image_covered || fill_gaps || image_covered[sector];
+}
+
+unsigned long flashrom_program_ms(unsigned long bytes)
+{
+    return (bytes * flashrom_type->program_us) / 1000;
+}
+
+typedef struct {
+    unsigned int dirty_sectors;  /* sectors which do not match the image */
+    unsigned long dirty_bytes;   /* bytes to program (not 0xFF) in the dirty sectors */
+    unsigned long image_bytes;   /* bytes to program in the whole chip */
+    bool chip_erase;             /* erase whole chip rather than individual sectors */
+    unsigned int erase_ops;      /* number of erase operations required */
+    unsigned long program_bytes; /* number of bytes that will be programmed */
+    unsigned long write_ms;      /* estimated erase and program time */
+} write_plan_t;
+
+/* choose between erasing only the dirty sectors or the whole chip */
+void flashrom_plan_write(const unsigned char *rom_image, const bool *dirty, write_plan_t *plan)
+{
+    unsigned int sector;
+    unsigned long programmed, chip_ms;
+    bool complete = true;
+
+    memset(plan, 0, sizeof(write_plan_t));
+
+    for(sector=region_first; sector < region_end; sector++){
+        if(!sector_in_image(sector))
+            complete = false;
+        programmed = count_programmed_bytes(&rom_image[flashrom_sector_address(sector)], flashrom_type->sector_size);
+        plan->image_bytes += programmed;
+        if(dirty[sector]){
+            plan->dirty_sectors++;
+            plan->dirty_bytes += programmed;
+        }
+    }
+
+    plan->program_bytes = plan->dirty_bytes;
+    plan->write_ms = (unsigned long)plan->dirty_sectors * flashrom_type->sector_erase_ms;
+
+    if(!(flashrom_type->strategy & ST_PROGRAM_SECTORS) && plan->dirty_sectors){
+        /* the image is padded with 0xFF so it covers the whole region; we can
+           erase the whole chip only if the region is the whole chip and, for a
+           hex file, the file covers every sector */
+        plan->erase_ops = plan->dirty_sectors;
+        plan->write_ms += flashrom_program_ms(plan->dirty_bytes);
+        chip_ms = flashrom_type->chip_erase_ms + flashrom_program_ms(plan->image_bytes);
+        if((flashrom_type->strategy & ST_ERASE_CHIP) || 
+           (region_first == 0 && region_end == flashrom_type->sector_count && complete && chip_ms < plan->write_ms)){
+            plan->chip_erase = true;
+            plan->erase_ops = 1;
+            plan->program_bytes = plan->image_bytes;
+            plan->write_ms = chip_ms;
+        }
+    }
+}
+
+void flashrom_print_plan_json(FILE *out, const bool *dirty, const write_plan_t *plan, unsigned long compare_ms)
+{
+    unsigned int sector;
+    bool first = true;
+
+    fprintf(out, "{\n  \"chip\": \"%s\",\n  \"chip_id\": \"0x%04X\",\n", flashrom_type->chip_name, flashrom_type->chip_id);
+    fprintf(out, "  \"sector_size\": %u,\n  \"sector_count\": %u,\n", flashrom_type->sector_size, flashrom_type->sector_count);
+    fprintf(out, "  \"region_offset\": %u,\n  \"region_length\": %u,\n", region_offset, region_length);
+    fprintf(out, "  \"dirty_sectors\": [");
+    for(sector=region_first; sector < region_end; sector++){
+        if(dirty[sector]){
+            fprintf(out, "%s%u", first ? "" : ", ", sector);
+            first = false;
+        }
+    }
+    fprintf(out, "],\n  \"erase\": \"%s\",\n  \"erase_operations\": %u,\n", 
+            !plan->dirty_sectors ? "none" : (plan->chip_erase ? "chip" : "sector"), plan->erase_ops);
+    fprintf(out, "  \"program_bytes\": %lu,\n  \"compare_ms\": %lu,\n  \"write_ms\": %lu,\n", 
+            plan->program_bytes, compare_ms, plan->write_ms);
+    /* the write compares the whole chip before programming, and again
+       afterwards only with --full-verify */
+    fprintf(out, "  \"estimated_ms\": %lu\n}\n",
+            plan->dirty_sectors ? plan->write_ms + (full_verify ? 2 : 1) * compare_ms : compare_ms);
+}
+
+unsigned long elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
 unsigned int flashrom_verify_and_write(const unsigned char *rom_image, bool perform_write)
 {
-    unsigned int sector=0, mismatch=0;
-    unsigned int offset;
-    bool eof = false;
+    unsigned int sector=0, mismatch=0, programmed=0, failed=0;
+    unsigned int offset, attempt;
+    unsigned long compare_ms;
+    struct timespec start;
+    write_plan_t plan;
+    bool *dirty;
+
+    /* If a sector already contains the desired data we avoid reprogramming it
+     * (thanks to John Coffman for this super idea). We first compare every
+     * sector, then plan and execute the cheapest way to erase and program the
+     * ones that differ, verifying each sector as soon as it is programmed.
+     * When writing, returns the number of sectors which still need verifying. */
+
+    dirty = calloc(flashrom_type->sector_count, sizeof(bool));
+    if(!dirty){
+        printf("Out of memory!\n");
+        _exit(1);
+    }
 
-    /* We verify or program at most one sector at once. If a sector already
-     * contains the desired data we avoid reprogramming it (thanks to John
-     * Coffman for this super idea). */
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    for(sector=0; (sector < flashrom_type->sector_count) && !eof; sector++){
-        printf("\r%s: sector %d/%d   ", perform_write ? "Write" : "Verify", sector, flashrom_type->sector_count);
+    for(sector=region_first; sector < region_end; sector++){
+        if(!sector_in_image(sector))
+            continue;
+        printf("\r%s: sector %d/%d   ", perform_write ? "Compare" : "Verify", sector, flashrom_type->sector_count);
         fflush(stdout);
 
-        /* verify sector */
         offset = flashrom_sector_address(sector);
-
         if(memcmp(&rom_image[offset], (char*)&flashrom_mapping[offset], flashrom_type->sector_size)){
+            dirty[sector] = true;
             mismatch++;
-            if(perform_write){
+        }
+    }
+
+    compare_ms = elapsed_ms(&start);
+
+    if(perform_write)
+        flashrom_plan_write(rom_image, dirty, &plan);
+
+    if(perform_write && plan_only){
+        printf("\rWrite plan: %d/%d sectors differ, %d erase operations, program %ld bytes\n",
+                mismatch, flashrom_type->sector_count, plan.erase_ops, plan.program_bytes);
+        flashrom_print_plan_json(plan_output, dirty, &plan, compare_ms);
+        free(dirty);
+        return mismatch;
+    }
+
+    if(perform_write && mismatch){
+        printf("\rWrite plan: %d sectors changed, %s erase, program %ld bytes\n",
+                plan.dirty_sectors, plan.chip_erase ? "chip" : "sector", plan.program_bytes);
+        printf("Estimated write time %ld.%02ld seconds\n", plan.write_ms / 1000, (plan.write_ms % 1000) / 10);
+
+        if(plan.chip_erase)
+            flashrom_chip_erase();
+
+        for(sector=region_first; sector < region_end; sector++){
+            if(!plan.chip_erase && !dirty[sector])
+                continue;
+
+            printf("\rWrite: sector %d/%d   ", sector, flashrom_type->sector_count);
+            fflush(stdout);
+            programmed++;
+
+            offset = flashrom_sector_address(sector);
+            for(attempt=1; ; attempt++){
                 /* erase and program sector */
                 if(flashrom_type->strategy & ST_PROGRAM_SECTORS){
                     /* This type of chip has a combined erase/program cycle that programs a whole
                        sector at once. The sectors are quite small (128 or 256 bytes). */
                     flashrom_sector_program(offset, &rom_image[offset], flashrom_type->sector_size);
                 }else{
-                    if(flashrom_type->strategy & ST_ERASE_CHIP)
-                        flashrom_chip_erase();
-                    else
-                        flashrom_sector_erase(offset);
-
+                    if(!plan.chip_erase || attempt > 1){
+                        if(flashrom_type->strategy & ST_ERASE_CHIP)
+                            flashrom_chip_erase();
+                        else
+                            flashrom_sector_erase(offset);
+                    }
                     flashrom_block_write(offset, &rom_image[offset], flashrom_type->sector_size);
                 }
+
+                /* verify the sector straight away; retry a few times if it fails */
+                if(memcmp(&rom_image[offset], (char*)&flashrom_mapping[offset], flashrom_type->sector_size) == 0)
+                    break;
+                if(attempt >= WRITE_ATTEMPTS){
+                    failed++;
+                    break;
+                }
+                printf("\rSector %d failed to verify, retrying\n", sector);
             }
         }
     }
 
+    free(dirty);
+
     /* report outcome */
     if(perform_write){
-        printf("\rWrite complete: Reprogrammed %d/%d sectors.\n", mismatch, flashrom_type->sector_count);
+        printf("\rWrite complete: Reprogrammed %d/%d sectors", programmed, flashrom_type->sector_count);
+        if(failed)
+            printf(", %d failed to verify", failed);
+        printf(".\n");
+        /* sectors are verified as they are programmed; ask for a final verify only if needed */
+        return (full_verify && programmed) ? programmed : failed;
     }else{
-        if(sector != flashrom_type->sector_count)
-            printf("\rPartial verify (%d/%d sectors)", sector-1, flashrom_type->sector_count);
-        else
-            printf("\rVerify (%d sectors)", flashrom_type->sector_count);
+        if(image_covered){
+            for(sector=region_first, offset=0; sector < region_end; sector++)
+                if(sector_in_image(sector))
+                    offset++;
+            printf("\rVerify (%d sectors in hex file)", offset);
+        }else
+            printf("\rVerify (%d sectors)", region_end - region_first);
 
         if(mismatch){
             printf(" complete: %d sectors contain errors.\n", mismatch);
@@ -290,16 +489,106 @@ unsigned int flashrom_verify_and_write(const unsigned char *rom_image, bool perf
     return mismatch;
 }
 
+bool flashrom_block_verify_constant(unsigned long address, unsigned char value, unsigned long length)
+{
+    const unsigned char volatile *ptr = &flashrom_mapping[address];
+
+    while(length--)
+        if(*(ptr++) != value)
+            return false;
+
+    return true;
+}
+
+/* check every sector in the region is erased, marking those that are not in dirty[] */
+unsigned int flashrom_blank_check(bool *dirty)
+{
+    unsigned int sector, mismatch = 0;
+
+    for(sector=region_first; sector < region_end; sector++){
+        printf("\rBlank check: sector %d/%d   ", sector, flashrom_type->sector_count);
+        fflush(stdout);
+        dirty[sector] = !flashrom_block_verify_constant(flashrom_sector_address(sector), 0xFF, flashrom_type->sector_size);
+        if(dirty[sector])
+            mismatch++;
+    }
+
+    printf("\rBlank check (%d sectors) complete: ", region_end - region_first);
+    if(mismatch)
+        printf("%d sectors are not blank.\n", mismatch);
+    else
+        printf("OK, all erased.\n");
+
+    return mismatch;
+}
+
+/* erase the sectors that are not blank, or the whole chip if that is quicker */
+unsigned int flashrom_erase(void)
+{
+    unsigned int sector, mismatch, erased = 0;
+    unsigned char *blank = NULL;
+    bool *dirty;
+
+    dirty = (bool*)calloc(flashrom_type->sector_count, sizeof(bool));
+    if(!dirty){
+        printf("calloc() failed\n");
+        _exit(1);
+    }
+
+    mismatch = flashrom_blank_check(dirty);
+
+    if(mismatch && !(flashrom_type->strategy & ST_PROGRAM_SECTORS) &&
+       region_first == 0 && region_end == flashrom_type->sector_count &&
+       ((flashrom_type->strategy & ST_ERASE_CHIP) || 
+        flashrom_type->chip_erase_ms < (unsigned long)mismatch * flashrom_type->sector_erase_ms)){
+        printf("\rErase: chip   ");
+        fflush(stdout);
+        flashrom_chip_erase();
+        erased = mismatch;
+    }else if(mismatch){
+        if(flashrom_type->strategy & ST_PROGRAM_SECTORS){
+            /* no erase command; program the sectors with 0xFF instead */
+            blank = (unsigned char*)malloc(flashrom_type->sector_size);
+            if(!blank){
+                printf("malloc() failed\n");
+                _exit(1);
+            }
+            memset(blank, 0xFF, flashrom_type->sector_size);
+        }
+        for(sector=region_first; sector < region_end; sector++){
+            if(!dirty[sector])
+                continue;
+            printf("\rErase: sector %d/%d   ", sector, flashrom_type->sector_count);
+            fflush(stdout);
+            if(blank)
+                flashrom_sector_program(flashrom_sector_address(sector), blank, flashrom_type->sector_size);
+            else
+                flashrom_sector_erase(flashrom_sector_address(sector));
+            erased++;
+        }
+        free(blank);
+    }
+
+    if(mismatch){
+        printf("\rErase complete: Erased %d/%d sectors.\n", erased, flashrom_type->sector_count);
+        mismatch = flashrom_blank_check(dirty);
+    }
+
+    free(dirty);
+
+    return mismatch;
+}
+
 bool check_file_size(unsigned int file_size)
 {
-    if(file_size == flashrom_size)
+    if(file_size == region_length)
         return true;
 
-    if(file_size > flashrom_size)
+    if(file_size > region_length)
         return false;
 
     if(allow_partial &&
-       (flashrom_size > file_size) && 
+       (region_length > file_size) && 
        (file_size != 0))
         return true;
 
@@ -347,6 +636,7 @@ unsigned char *read_rom_image(int img_fd)
         return NULL;
     }
 
+    /* the image is held at its location in the flash, we use only the region */
     img_data=(unsigned char*)malloc(flashrom_size);
     if(!img_data){
         printf("Out of memory!\n");
@@ -355,7 +645,7 @@ unsigned char *read_rom_image(int img_fd)
 
     lseek(img_fd, 0, SEEK_SET);
     for(offset = 0; offset < img_size;){
-        r = read(img_fd, &img_data[offset], img_size - offset);
+        r = read(img_fd, &img_data[region_offset + offset], img_size - offset);
         if(r < 0){
             printf("read() failed: %s\n", strerror(errno));
             free(img_data);
@@ -364,22 +654,149 @@ unsigned char *read_rom_image(int img_fd)
         offset += r;
     }
 
-    if(img_size < flashrom_size) /* pad with unprogrammed bytes if space left over */
-        memset(&img_data[img_size], 0xFF, flashrom_size - img_size);
+    if(img_size < region_length) /* pad with unprogrammed bytes if space left over */
+        memset(&img_data[region_offset + img_size], 0xFF, region_length - img_size);
 
     return img_data;
 }
 
+bool hex_filename(const char *filename)
+{
+    static const char *extensions[] = { "hex", "ihx", "s19", "s28", "s37", "sre", "srec", "mot", NULL };
+    const char *ext;
+    int i;
+
+    ext = strrchr(filename, '.');
+    if(!ext)
+        return false;
+    for(i=0; extensions[i]; i++)
+        if(strcasecmp(ext+1, extensions[i]) == 0)
+            return true;
+
+    return false;
+}
+
+/* parse "count" bytes of hex digits, adding them to the checksum */
+bool hex_bytes(const char **text, unsigned char *out, unsigned int count, unsigned char *sum)
+{
+    unsigned int value;
+
+    while(count--){
+        if(!isxdigit((unsigned char)(*text)[0]) || !isxdigit((unsigned char)(*text)[1]) ||
+           sscanf(*text, "%2x", &value) != 1)
+            return false;
+        *(out++) = value;
+        *sum += value;
+        *text += 2;
+    }
+
+    return true;
+}
+
+/* Read an Intel HEX or S-record file into an image of the flash, padded with
+   0xFF, marking the sectors the file covers in image_covered */
+unsigned char *read_hex_image(FILE *in)
+{
+    char line[600];
+    const char *p;
+    unsigned char *img_data, bytes[4+255+1], sum, type, count; /* Intel HEX header, data, checksum */
+    unsigned long base = 0, address, end;
+    unsigned int line_number = 0, i, sector, covered = 0;
+    bool done = false;
+
+    img_data = (unsigned char*)malloc(flashrom_size);
+    image_covered = (bool*)calloc(flashrom_type->sector_count, sizeof(bool));
+    if(!img_data || !image_covered){
+        printf("Out of memory!\n");
+        return NULL;
+    }
+    memset(img_data, 0xFF, flashrom_size);
+
+    while(!done && fgets(line, sizeof(line), in)){
+        line_number++;
+        p = line + strspn(line, " \t");
+        if(*p == '\r' || *p == '\n' || *p == 0)
+            continue;
+        sum = 0;
+        if(*p == ':'){
+            /* Intel HEX: count, 16-bit address, type, data, checksum; sums to 0 */
+            p++;
+            if(!hex_bytes(&p, bytes, 4, &sum) || !hex_bytes(&p, bytes+4, bytes[0]+1, &sum) || sum != 0)
+                goto bad_line;
+            count = bytes[0];
+            type = bytes[3];
+            address = base + ((bytes[1] << 8) | bytes[2]);
+            if(type == 1)
+                done = true;
+            else if((type == 2 || type == 4) && count == 2)
+                base = (unsigned long)((bytes[4] << 8) | bytes[5]) << (type == 2 ? 4 : 16);
+            else if(type == 3 || type == 5)
+                continue;
+            else if(type != 0)
+                goto bad_line;
+            if(type != 0)
+                continue;
+            memmove(bytes, bytes+4, count);
+        }else if(*p == 'S' && p[1] >= '0' && p[1] <= '9'){
+            /* S-record: type, count, 16/24/32-bit address, data, checksum; sums to 0xFF */
+            type = p[1] - '0';
+            p += 2;
+            if(!hex_bytes(&p, bytes, 1, &sum) || bytes[0] < 1 || !hex_bytes(&p, bytes+1, bytes[0], &sum) || sum != 0xFF)
+                goto bad_line;
+            if(type >= 7)
+                break;
+            if(type < 1 || type > 3)
+                continue;
+            if(bytes[0] < type + 2)
+                goto bad_line;
+            count = bytes[0] - type - 2;
+            for(i=0, address=0; i < type + 1; i++)
+                address = (address << 8) | bytes[1+i];
+            memmove(bytes, bytes + type + 2, count);
+        }else
+            goto bad_line;
+
+        if(!count)
+            continue;
+        end = address + count;
+        if(address < region_offset || end > region_offset + region_length){
+            printf("Hex file data at 0x%06lX on line %d lies outside the flash ROM region.\n", address, line_number);
+            return NULL;
+        }
+        memcpy(&img_data[address], bytes, count);
+        for(sector = address / flashrom_type->sector_size; sector <= (end - 1) / flashrom_type->sector_size; sector++)
+            image_covered[sector] = true;
+    }
+
+    for(sector=region_first; sector < region_end; sector++)
+        if(sector_in_image(sector))
+            covered++;
+    printf("Hex file covers %d sectors%s\n", covered, fill_gaps ? " with gaps filled" : "");
+
+    return img_data;
+
+bad_line:
+    printf("Hex file error on line %d\n", line_number);
+    return NULL;
+}
+
 void usage(const char *cmdname)
 {
-    printf("Usage: %s [OPTION...] COMMAND filename\n", cmdname);
+    printf("Usage: %s [OPTION...] COMMAND [filename]\n", cmdname);
     printf("\nOPTION:\n");
     printf(" -h --help      This usage summary\n");
     printf(" -p --partial   Allow ROM and file sizes to differ\n");
+    printf(" --offset N     Operate on the flash from offset N (bytes, 0x for hex)\n");
+    printf(" --length N     Operate on N bytes of flash only\n");
+    printf("    --plan      With --write, print the write plan as JSON without writing\n");
+    printf("    --full-verify  Verify the whole ROM after writing\n");
+    printf("    --fill-gaps    Treat sectors not in a hex file as blank\n");
     printf("\nCOMMAND:\n");
     printf(" -r --read      Read ROM conents out to file\n");
     printf(" -v --verify    Compare ROM contents to file\n");
     printf(" -w --write     Rewrite ROM contents from file\n");
+    printf("    --blank     Check ROM is erased (no file)\n");
+    printf("    --erase     Erase ROM (no file)\n");
 }
 
 int main(int argc, const char *argv[])
@@ -387,15 +804,24 @@ int main(int argc, const char *argv[])
     int i, img_fd = -1;
     unsigned int mismatch;
     unsigned char *img_data;
+    bool *dirty;
     const char *filename = NULL;
-    printf("FLASH030 by Will Sowerbutts <will@sowerbutts.com> version 1.0.0\n\n");
-
-    sync(); // just in case we break something
+    FILE *img_file;
 
     // command line arguments
     for(i=1; i<argc; i++){
         if(strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--partial") == 0){
             allow_partial = true;
+        }else if(strcmp(argv[i], "--plan") == 0){
+            plan_only = true;
+        }else if(strcmp(argv[i], "--full-verify") == 0){
+            full_verify = true;
+        }else if(strcmp(argv[i], "--fill-gaps") == 0){
+            fill_gaps = true;
+        }else if(strcmp(argv[i], "--offset") == 0 && i+1 < argc){
+            region_offset = strtoul(argv[++i], NULL, 0);
+        }else if(strcmp(argv[i], "--length") == 0 && i+1 < argc){
+            region_length = strtoul(argv[++i], NULL, 0);
         }else if(strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0){
             usage(argv[0]);
             return 0;
@@ -420,6 +846,13 @@ int main(int argc, const char *argv[])
                 return 1;
             }
             action = ACTION_VERIFY;
+        }else if(strcmp(argv[i], "--blank") == 0 || strcmp(argv[i], "--erase") == 0){
+            if(action != ACTION_UNKNOWN){
+                printf("More than one command specified!\n");
+                usage(argv[0]);
+                return 1;
+            }
+            action = (argv[i][2] == 'b') ? ACTION_BLANK : ACTION_ERASE;
         }else{
             if(filename == NULL)
                 filename = argv[i];
@@ -437,6 +870,28 @@ int main(int argc, const char *argv[])
         return 1;
     }
 
+    /* --blank and --erase take no image file, the other commands require one */
+    if((action == ACTION_BLANK || action == ACTION_ERASE) == (filename != NULL)){
+        printf(filename ? "Unexpected filename \"%s\"\n" : "No filename specified!\n", filename);
+        usage(argv[0]);
+        return 1;
+    }
+
+    if(plan_only){
+        if(action != ACTION_WRITE){
+            printf("--plan can only be used with --write\n");
+            return 1;
+        }
+        // keep stdout for the JSON plan, everything else goes to stderr
+        fflush(stdout);
+        plan_output = fdopen(dup(STDOUT_FILENO), "w");
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+
+    printf("FLASH030 by Will Sowerbutts <will@sowerbutts.com> version 1.0.0\n\n");
+
+    sync(); // just in case we break something
+
     if(!map_flashrom())
         return 1;
 
@@ -452,9 +907,25 @@ int main(int argc, const char *argv[])
             flashrom_type->sector_count, flashrom_type->sector_size,
             flashrom_size >> 10);
 
+    if(!region_length && region_offset < flashrom_size)
+        region_length = flashrom_size - region_offset;
+
+    /* writing and verifying work with whole sectors */
+    if(region_offset >= flashrom_size || region_length > flashrom_size - region_offset || 
+       (action != ACTION_READ && (region_offset % flashrom_type->sector_size || region_length % flashrom_type->sector_size))){
+        printf("--offset and --length must lie within the flash ROM and be multiples of the sector size\n");
+        return 1;
+    }
+    region_first = region_offset / flashrom_type->sector_size;
+    region_end = (region_offset + region_length + flashrom_type->sector_size - 1) / flashrom_type->sector_size;
+
     /* execute action */
     switch(action){
         case ACTION_READ:
+            if(hex_filename(filename)){
+                printf("--read writes binary image files only\n");
+                return 1;
+            }
             img_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
             if(img_fd < 0){
                 printf("Cannot create image file \"%s\": %s\n", filename, strerror(errno));
@@ -469,17 +940,38 @@ int main(int argc, const char *argv[])
                 printf("Cannot open image file \"%s\": %s\n", filename, strerror(errno));
                 return 1;
             }
-            img_data = read_rom_image(img_fd);
+            if(hex_filename(filename)){
+                img_file = fdopen(img_fd, "r");
+                img_data = img_file ? read_hex_image(img_file) : NULL;
+            }else
+                img_data = read_rom_image(img_fd);
             if(!img_data)
                 return 1;
             if(action == ACTION_VERIFY)
                 mismatch = 1;
-            else /* ACTION_WRITE */
-                mismatch = flashrom_verify_and_write(img_data, true); /* we avoid verifying if nothing changed */
+            else if(plan_only){
+                flashrom_verify_and_write(img_data, true);
+                fclose(plan_output);
+                mismatch = 0;
+            }else /* ACTION_WRITE */
+                mismatch = flashrom_verify_and_write(img_data, true); /* sectors left unverified */
             if(mismatch)
                 flashrom_verify_and_write(img_data, false);
             free(img_data);
             break;
+        case ACTION_BLANK:
+            dirty = (bool*)calloc(flashrom_type->sector_count, sizeof(bool));
+            if(!dirty){
+                printf("calloc() failed\n");
+                _exit(1);
+            }
+            flashrom_blank_check(dirty);
+            free(dirty);
+            break;
+        case ACTION_ERASE:
+            if(flashrom_erase())
+                printf("\n*** ERASE FAILED ***\n\n");
+            break;
         default:
             printf("?!?!\n");
             _exit(1);
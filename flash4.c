@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdbool.h>
 #include "libcpm.h"
@@ -6,13 +7,21 @@
 #include "bankswitch.h"
 #include "detectcpu.h"
 #include "buffers.h"
+#include "hexfile.h"
+#include "timer.h"
+#include "xmodem.h"
 #include "calling.h"
 
 typedef enum { 
     ACTION_UNKNOWN, 
     ACTION_READ, 
     ACTION_WRITE, 
-    ACTION_VERIFY 
+    ACTION_VERIFY,
+    ACTION_BLANK,
+    ACTION_ERASE,
+    ACTION_ROLLBACK,
+    ACTION_COPY,
+    ACTION_BENCH
 } action_t;
 
 static action_t action = ACTION_UNKNOWN;
@@ -32,6 +41,40 @@ typedef enum {
 
 static access_t access = ACCESS_AUTO;
 
+static const char * const access_names[] = {
+    "", "",
+    "RomWBW (old) bank switching",
+    "RomWBW (v2.6+) bank switching",
+    "UNA BIOS bank switching",
+    "Z180 DMA engine",
+    "P112 bank switching",
+    "N8VEM SBC bank switching"
+};
+
+/* BENCH /SAVE records the fastest access method in this file, which the
+   auto-detection then prefers for as long as that method is available */
+#define PREFS_FILENAME "FLASH4.CFG"
+#define PREFS_MAGIC 0x4650
+
+typedef struct {
+    unsigned int magic;
+    unsigned char access;
+} prefs_t;
+
+/* BENCH times each test for at least this long, longer with a coarse clock */
+#define BENCH_MS            500
+#define BENCH_MS_COARSE    3000
+#define BENCH_REGION    0x8000UL /* reads cycle through the first 32KB of the flash */
+#define BENCH_CHUNK     (CPM_BLOCK_SIZE * FILEBUFFER_BLOCKS)
+#define BENCH_POLLS           64 /* toggle bit polls between readings of the clock */
+#define BENCH_DISK_RECORDS  1024 /* the disk test writes at most 128KB */
+#define BENCH_FILENAME  "FLASH4.$$$"
+
+#define BENCH_READ      0
+#define BENCH_VERIFY    1
+#define BENCH_POLL      2
+#define MAX_BENCH_METHODS 6
+
 /* the strategy flags describe quirks for programming particular chips */
 #define ST_NORMAL               (0x00) /* default: no special strategy required */
 #define ST_PROGRAM_SECTORS      (0x01) /* bit 0: program sector (not byte) at a time (Atmel AT29C style) */
@@ -43,72 +86,332 @@ typedef struct {
     unsigned int sector_size;  /* in multiples of 128 bytes */
     unsigned int sector_count;
     unsigned char strategy;
+    /* typical timings from the data sheets, used to plan and estimate writes */
+    unsigned int sector_erase_ms; /* sector erase (ST_PROGRAM_SECTORS: sector program cycle) */
+    unsigned int chip_erase_ms;   /* whole chip erase */
+    unsigned char program_us;     /* single byte program */
+    unsigned char access_ns;      /* read access time of the slowest speed grade, 0 = unknown */
 } flashrom_chip_t; 
 
 static flashrom_chip_t flashrom_chips[] = {
-    { 0x0120, "29F010",      128,    8, ST_NORMAL },
-    { 0x01A4, "29F040",      512,    8, ST_NORMAL },
-    { 0x1F04, "AT49F001NT", 1024,    1, ST_ERASE_CHIP }, /* multiple but unequal sized sectors */
-    { 0x1F05, "AT49F001N",  1024,    1, ST_ERASE_CHIP }, /* multiple but unequal sized sectors */
-    { 0x1F07, "AT49F002N",  2048,    1, ST_ERASE_CHIP }, /* multiple but unequal sized sectors */
-    { 0x1F08, "AT49F002NT", 2048,    1, ST_ERASE_CHIP }, /* multiple but unequal sized sectors */
-    { 0x1F13, "AT49F040",   4096,    1, ST_ERASE_CHIP }, /* single sector device */
-    { 0x1F5D, "AT29C512",      1,  512, ST_PROGRAM_SECTORS },
-    { 0x1FA4, "AT29C040",      2, 2048, ST_PROGRAM_SECTORS },
-    { 0x1FD5, "AT29C010",      1, 1024, ST_PROGRAM_SECTORS },
-    { 0x1FDA, "AT29C020",      2, 1024, ST_PROGRAM_SECTORS },
-    { 0x2020, "M29F010",     128,    8, ST_NORMAL },
-    { 0x20E2, "M29F040",     512,    8, ST_NORMAL },
-    { 0x37A4, "A29010B",     256,    4, ST_NORMAL },
-    { 0x3786, "A29040B",     512,    8, ST_NORMAL },
-    { 0xBFD5, "39VF010",      32,   32, ST_NORMAL },
-    { 0xBFD6, "39VF020",      32,   64, ST_NORMAL },
-    { 0xBFD7, "39VF040",      32,  128, ST_NORMAL },
-    { 0xBFB5, "39SF010",      32,   32, ST_NORMAL },
-    { 0xBFB6, "39SF020",      32,   64, ST_NORMAL },
-    { 0xBFB7, "39SF040",      32,  128, ST_NORMAL },
-    { 0xC2A4, "MX29F040",    512,    8, ST_NORMAL },
+    { 0x0120, "29F010",      128,    8, ST_NORMAL,          1000,  8000,  7, 150 },
+    { 0x0141, "29F032",      512,   64, ST_NORMAL,          1000, 64000,  7, 150 },
+    { 0x01A4, "29F040",      512,    8, ST_NORMAL,          1000,  8000,  7, 150 },
+    { 0x01AD, "29F016",      512,   32, ST_NORMAL,          1000, 32000,  7, 150 },
+    { 0x1F04, "AT49F001NT", 1024,    1, ST_ERASE_CHIP,     10000, 10000, 30, 120 }, /* multiple but unequal sized sectors */
+    { 0x1F05, "AT49F001N",  1024,    1, ST_ERASE_CHIP,     10000, 10000, 30, 120 }, /* multiple but unequal sized sectors */
+    { 0x1F07, "AT49F002N",  2048,    1, ST_ERASE_CHIP,     10000, 10000, 30, 120 }, /* multiple but unequal sized sectors */
+    { 0x1F08, "AT49F002NT", 2048,    1, ST_ERASE_CHIP,     10000, 10000, 30, 120 }, /* multiple but unequal sized sectors */
+    { 0x1F13, "AT49F040",   4096,    1, ST_ERASE_CHIP,     10000, 10000, 30, 120 }, /* single sector device */
+    { 0x1F5D, "AT29C512",      1,  512, ST_PROGRAM_SECTORS,   10,     0,  0, 200 },
+    { 0x1FA4, "AT29C040",      2, 2048, ST_PROGRAM_SECTORS,   10,     0,  0, 200 },
+    { 0x1FD5, "AT29C010",      1, 1024, ST_PROGRAM_SECTORS,   10,     0,  0, 200 },
+    { 0x1FDA, "AT29C020",      2, 1024, ST_PROGRAM_SECTORS,   10,     0,  0, 200 },
+    { 0x2020, "M29F010",     128,    8, ST_NORMAL,          1000,  8000, 10, 120 },
+    { 0x20AC, "M29F032",     512,   64, ST_NORMAL,          1000, 64000, 10, 120 },
+    { 0x20AD, "M29F016",     512,   32, ST_NORMAL,          1000, 32000, 10, 120 },
+    { 0x20E2, "M29F040",     512,    8, ST_NORMAL,          1000,  8000, 10, 120 },
+    { 0x37A4, "A29010B",     256,    4, ST_NORMAL,          1000,  4000,  7,  90 },
+    { 0x3786, "A29040B",     512,    8, ST_NORMAL,          1000,  8000,  7,  90 },
+    { 0xBFD5, "39VF010",      32,   32, ST_NORMAL,            18,    70, 14,  70 },
+    { 0xBFD6, "39VF020",      32,   64, ST_NORMAL,            18,    70, 14,  70 },
+    { 0xBFD7, "39VF040",      32,  128, ST_NORMAL,            18,    70, 14,  70 },
+    { 0xBFB5, "39SF010",      32,   32, ST_NORMAL,            18,    70, 14,  70 },
+    { 0xBFB6, "39SF020",      32,   64, ST_NORMAL,            18,    70, 14,  70 },
+    { 0xBFB7, "39SF040",      32,  128, ST_NORMAL,            18,    70, 14,  70 },
+    { 0xC2A4, "MX29F040",    512,    8, ST_NORMAL,          1000,  4000,  7, 120 },
     /* terminate the list */
-    { 0x0000, NULL,            0,    0, 0 }
+    { 0x0000, NULL,            0,    0, 0,                     0,     0,  0,   0 }
 };
 
 /* special ROM entry for ROM/EPROM/EEPROM with /ROM switch */
-static flashrom_chip_t rom_chip = { 0x0000, "rom", 8, 512, 0 }; /* 512 x 1KB "sectors" */
+static flashrom_chip_t rom_chip = { 0x0000, "rom", 8, 512, 0, 0, 0, 0, 0 }; /* 512 x 1KB "sectors" */
+#define ROM_MIN_SIZE 0x8000UL /* smallest ROM size flashrom_rom_size() looks for */
 static flashrom_chip_t *flashrom_type = NULL;
 
 static bool verbose = false;
+static bool quiet = false;
+static bool plan_only = false;
 static bool chip_count_forced = false;
 static unsigned int chip_count = 1;        /* number of chips */
 static unsigned long flashrom_chip_size;   /* individual chip size, in bytes */
 static unsigned long flashrom_size;        /* total size of all chips, in bytes; always equal to chip_count * flashrom_chip_size */
 static unsigned long flashrom_sector_size; /* chip sector size, in bytes */
 
+/* subdivision of sectors into chunks that fit our file buffer */
+static unsigned int subsectors_per_sector, blocks_per_subsector, bytes_per_subsector;
+static unsigned int image_end;            /* sector after the last one covered by the image file */
+
+/* region of the flash we operate on, set with /OFFSET and /LENGTH */
+static unsigned long region_offset = 0;   /* in bytes */
+static unsigned long region_length = 0;   /* in bytes, 0 means up to the end of the flash */
+static unsigned int region_first;         /* first sector in the region */
+static unsigned int region_end;           /* sector after the last sector in the region */
+
+#define MAX_CHIP_COUNT 9
+
+/* an erase or program cycle is abandoned after this many times its typical
+   duration plus FLASH_TIMEOUT_MIN_MS, generously covering the data sheet maximum */
+#define FLASH_TIMEOUT_FACTOR    8
+#define FLASH_TIMEOUT_MIN_MS 1000
+
+/* per-chip results of the compare pass, used to plan the erase strategy */
+typedef struct {
+    unsigned int dirty_sectors;  /* sectors which do not match the image */
+    unsigned long dirty_bytes;   /* bytes to program (not 0xFF) in the dirty sectors */
+    unsigned long image_bytes;   /* bytes to program in all sectors of the chip */
+    bool complete;               /* image file covers the whole chip */
+    bool chip_erase;             /* plan: erase whole chip rather than individual sectors */
+} chip_plan_t;
+
+static chip_plan_t chip_plan[MAX_CHIP_COUNT];
+
+/* The checkpoint file records the progress of WRITE so that an interrupted
+   write can be resumed. Record 0 holds the header, followed by one state byte
+   per sector, 128 sectors to a record. */
+#define CHECKPOINT_MAGIC 0x4B43
+#define CKPT_CLEAN      0 /* sector matched the image and is left alone */
+#define CKPT_DIRTY      1 /* sector must be erased and programmed */
+#define CKPT_ERASED     2 /* sector has been erased */
+#define CKPT_VERIFIED   4 /* sector has been programmed and verified */
+
+typedef struct {
+    unsigned int magic;
+    unsigned int chip_id;
+    unsigned int sector_count;   /* total sectors, all chips */
+    unsigned int region_first;   /* first sector of the region written */
+    unsigned int image_end;      /* sector after the last covered by the image file */
+    unsigned long image_size;    /* image file size, in 128-byte blocks */
+    unsigned int image_digest;   /* CRC of the whole image, as the compare pass read it */
+} checkpoint_header_t;
+
+static cpm_fcb checkpoint_file;
+static bool checkpoint_active = false;
+static bool checkpoint_dirty = false;    /* checkpointbuffer needs writing back */
+static unsigned int checkpoint_record;   /* record held in checkpointbuffer */
+static bool resumed = false;             /* WRITE is completing an interrupted write */
+
+/* results from programming a sector */
+#define PROGRAM_OK      0 /* programmed and verified */
+#define PROGRAM_EOF     1 /* reached the end of the image file */
+#define PROGRAM_FAILED  2 /* flash contents did not verify after programming */
+
+#define WRITE_ATTEMPTS  3 /* times we try to program a sector before giving up */
+
+/* Intel HEX and S-record image files, and undo files, cover only parts of
+   the flash; the sectors they cover are marked in image_map (see
+   image_scan_hex and undo_load) */
+#define IMAGE_BINARY 0 /* flat image of the region */
+#define IMAGE_HEX    1 /* hex file (see hexfile.c) */
+#define IMAGE_UNDO   2 /* sectors saved by WRITE /UNDO (see undo_create) */
+#define IMAGE_FLASH  3 /* another part of the flash, for COPY */
+#define IMAGE_SERIAL 4 /* XMODEM or YMODEM transfer, a sector at a time (see flashrom_serial_write) */
+static unsigned char image_type = IMAGE_BINARY;
+static unsigned long copy_source;        /* COPY reads the region's data from here */
+
+/* /STAGE loads a binary image into the RomWBW RAM disk banks in one
+   sequential pass; the compare, program and verify passes then read it from
+   RAM instead of disk. READ captures the flash to RAM before writing it out. */
+static bool stage = false;
+static unsigned long stage_records = 0;  /* records of the image held in RAM */
+static bool bios_copy = true;            /* use the BIOS inter-bank copy where there is one */
+
+/* /FASTREAD: on a Z180, bulk reads and compares of the flash run with fewer
+   memory wait states. Only the fast_block_ functions change DCNTL and they
+   always put it back, so program and erase cycles never see the change. */
+#define Z180_DCNTL              0x72 /* internal registers at 0x40, where RomWBW and UNA put them */
+#define Z180_DCNTL_MWI          0xC0 /* memory wait states, bits 7-6 */
+#define Z180_READ_OVERHEAD_NS     40 /* address and data setup within the 1.5 clock memory read */
+#define FASTREAD_CHECK_BYTES 0x8000UL /* digest of this much of the flash must not change... */
+#define FASTREAD_CHECK_PASSES      4 /* ...over this many reads */
+
+static bool fast_read = false;           /* /FASTREAD given */
+static bool fast_active = false;         /* wait states are reduced for reads */
+static unsigned char dcntl_normal;       /* DCNTL (P112: the wait state bits used with the ROM mapped) */
+static unsigned char dcntl_fast;
+/* READ, VERIFY and WRITE can move the image over a serial line instead of a file */
+#define SERIAL_NONE   0
+#define SERIAL_XMODEM 1
+#define SERIAL_YMODEM 2 /* READ sends a YMODEM header; receiving takes either */
+#define SERIAL_DEFAULT_NAME "FLASH.ROM" /* YMODEM name when READ is not given one */
+static unsigned char serial = SERIAL_NONE;
+static bool serial_console = false;      /* the transfer uses the console, so we print nothing until it ends */
+static bool serial_ram = false;          /* sectors are too big for filebuffer and are held in the RAM disk banks */
+static bool serial_short = false;        /* the transfer ended part way through the last sector received */
+
+/* VERIFY against several images at once (see flashrom_verify_images) */
+#define MAX_VERIFY_IMAGES    8
+#define VERIFY_CHUNK_BLOCKS (FILEBUFFER_BLOCKS / 2) /* flash in one half of filebuffer, an image in the other */
+
+typedef struct {
+    const char *filename;
+    cpm_fcb file;
+    unsigned long blocks;      /* length of the image, within the region */
+    bool exact;                /* matches the flash so far */
+    unsigned long resume;      /* block where the first pass found a difference */
+    unsigned int differ;       /* sectors found to differ */
+    bool counted;              /* differ is complete, not just a lower bound */
+} verify_image_t;
+
+static verify_image_t verify_images[MAX_VERIFY_IMAGES];
+
+static bool fill_gaps = false;           /* treat sectors the hex file does not cover as blank */
+static unsigned int image_map_end;       /* sector after the last one marked in image_map */
+
+/* WRITE /UNDO saves the current contents of the sectors it is about to
+   change in an undo file, which ROLLBACK writes back. Record 0 holds the
+   header, followed by the sector numbers (64 to a record, ascending) and
+   then the contents of each sector in turn. */
+#define UNDO_MAGIC 0x4E55
+#define UNDO_SECTORS_PER_RECORD (CPM_BLOCK_SIZE / sizeof(unsigned int))
+
+typedef struct {
+    unsigned int magic;
+    unsigned int chip_id;
+    unsigned int sector_count;   /* total sectors, all chips */
+    unsigned int sector_size;    /* in 128-byte blocks */
+    unsigned int saved_sectors;  /* sectors in the file */
+    unsigned int saved_digest;   /* CRC of the saved sector contents */
+} undo_header_t;
+
+static bool undo = false;                /* WRITE saves the sectors it changes first */
+static cpm_fcb undo_file;
+static unsigned long undo_data_record;   /* record holding the first saved sector */
+
+static bool full_verify = false;         /* verify the whole image after WRITE, not just the sectors changed */
+static bool targeted_verify = false;     /* verify only the sectors in sector_map */
+static unsigned int image_digest;
+static unsigned long compare_read_ms;      /* time the compare pass spent reading the image... */
+static unsigned long compare_read_records; /* ...and the records it read, for the /PLAN estimate */
+
+/* Single platform builds (see Makefile) define ACCESS_ONLY as the access
+   method to use, plus Z180DMA_ONLY for the Z180 DMA engine. They call the
+   access functions directly and leave out the auto-detection and the code
+   for the other access methods. */
+#if defined(Z180DMA_ONLY)
+#define flashrom_chip_write             flashrom_chip_write_z180dma
+#define flashrom_chip_read              flashrom_chip_read_z180dma
+#define flashrom_block_read             flashrom_block_read_z180dma
+#define flashrom_block_verify           flashrom_block_verify_z180dma
+#define flashrom_block_verify_constant  flashrom_block_verify_constant_z180dma
+#define flashrom_block_write            flashrom_block_write_z180dma
+#define rom_bank_count                  0 /* only the BIOS can tell us this */
+#elif defined(ACCESS_ONLY)
+#define flashrom_chip_write             flashrom_chip_write_bankswitch
+#define flashrom_chip_read              flashrom_chip_read_bankswitch
+#define flashrom_block_read             flashrom_block_read_bankswitch
+#define flashrom_block_verify           flashrom_block_verify_bankswitch
+#define flashrom_block_verify_constant  flashrom_block_verify_constant_bankswitch
+#define flashrom_block_write            flashrom_block_write_bankswitch
+#else
 /* function pointers set at runtime to switch between bank switching and Z180 DMA engine */
 void (*flashrom_chip_write)(unsigned long address, unsigned char value) CALLING = NULL;
 unsigned char (*flashrom_chip_read)(unsigned long address) CALLING = NULL;
 void (*flashrom_block_read)(unsigned long address, unsigned char *buffer, unsigned int length) CALLING = NULL;
 bool (*flashrom_block_verify)(unsigned long address, unsigned char *buffer, unsigned int length) CALLING = NULL;
+bool (*flashrom_block_verify_constant)(unsigned long address, unsigned char value, unsigned int length) CALLING = NULL;
 void (*flashrom_block_write)(unsigned long address, unsigned char *buffer, unsigned int length) CALLING = NULL;
+#endif
+
+/* Progress reports are limited to one each PROGRESS_MS, so that a slow
+   serial console does not hold up the work; without a clock one report in
+   PROGRESS_CALLS is shown. /V shows every report and /Q none at all. */
+#define PROGRESS_MS     500
+#define PROGRESS_CALLS    8
+
+typedef struct {
+    unsigned long last;       /* timer_elapsed_ms() at the last report shown */
+    unsigned char calls;      /* reports asked for; 0 before the first */
+} progress_t;
+
+static progress_t progress_line, progress_spin;
+
+bool progress_due(progress_t *progress)
+{
+    unsigned long now;
+
+    if(quiet)
+        return false;
+
+    if(timer_clock == TIMER_CLOCK_NONE)
+        return (progress->calls++ % PROGRESS_CALLS) == 0;
+
+    now = timer_elapsed_ms();
+    if(progress->calls && now - progress->last < PROGRESS_MS)
+        return false;
+    progress->calls = 1;
+    progress->last = now;
+    return true;
+}
+
+/* print a progress report, if one is due, and make sure it is seen */
+void progress(const char *format, ...)
+{
+    va_list args;
+
+    if(!verbose && !progress_due(&progress_line))
+        return;
+
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    console_flush();
+}
 
 /* useful to provide some feedback that something is actually happening with large-sector devices */
 #define SPINNER_LENGTH 4
 static char spinner_char[SPINNER_LENGTH] = {'|', '/', '-', '\\'};
 static unsigned char spinner_pos=0;
 
-char spinner(void)
+void spinner(void)
 {
+    if(!progress_due(&progress_spin))
+        return;
     spinner_pos = (spinner_pos + 1) % SPINNER_LENGTH;
-    return spinner_char[spinner_pos];
+    putchar('\x08');
+    putchar(spinner_char[spinner_pos]);
+    console_flush();
+}
+
+void banner(void)
+{
+    static bool shown = false;
+
+    if(!shown)
+        puts("FLASH4 by Will Sowerbutts <will@sowerbutts.com> version 1.3.9\n");
+    shown = true;
 }
 
 void help(void)
 {
+    banner();
     puts("\nSyntax:\n\tFLASH4 READ filename [options]\n" \
-            "\tFLASH4 VERIFY filename [options]\n" \
-            "\tFLASH4 WRITE filename [options]\n\n" \
+            "\tFLASH4 VERIFY filename [filename ...] [options]\n" \
+            "\tFLASH4 WRITE filename [options]\n" \
+            "\tFLASH4 ROLLBACK undofile [options]\n" \
+            "\tFLASH4 BLANK [options]\n" \
+            "\tFLASH4 ERASE [options]\n" \
+            "\tFLASH4 COPY /FROM=n [options]\n" \
+            "\tFLASH4 BENCH [/SAVE] [options]\n\n" \
             "Options (access method is auto-detected by default)\n" \
             "\t/V\t\tVerbose details about verify/program process\n" \
+            "\t/Q\t\tQuiet: report only the outcome and any problems\n" \
             "\t/PARTIAL\tAllow flashing a large ROM from a smaller image file\n" \
+            "\t/PLAN\t\tShow what WRITE would change, without writing\n" \
+            "\t/FULLVERIFY\tVerify the whole ROM after WRITE\n" \
+            "\t/UNDO\t\tWRITE saves the sectors it changes for ROLLBACK\n" \
+            "\t/UPDATE\t\tREAD rewrites only changed records of an existing file\n" \
+            "\t/OFFSET=n\tOperate on the flash from offset n (eg 0x40000, 256K)\n" \
+            "\t/LENGTH=n\tOperate on n bytes of flash only\n" \
+            "\t/FROM=n\t\tCOPY the region's new contents from flash offset n\n" \
+            "\t/FILLGAPS\tTreat sectors not in a hex file as blank\n" \
+            "\t/STAGE\t\tHold the image in the RAM disk banks (RomWBW)\n" \
+            "\t/XMODEM[=n]\tTransfer the image by XMODEM on the console or HBIOS unit n\n" \
+            "\t/YMODEM[=n]\tAs /XMODEM, but READ sends a YMODEM header\n" \
+            "\t/IRQMAX=n\tHold interrupts off for at most n us at a time\n" \
+            "\t/NOBIOSCOPY\tSwitch banks ourselves even if the BIOS can copy\n" \
+            "\t/FASTREAD\tRead with fewer memory wait states (Z180)\n" \
+            "\t/SAVE\t\tBENCH: prefer the fastest access method from now on\n" \
             "\t/ROM\t\tAllow read-only use of unknown chip types\n" \
             "\t/Z180DMA\tForce Z180 DMA engine\n" \
             "\t/UNABIOS\tForce UNA BIOS bank switching\n" \
@@ -119,6 +422,23 @@ void help(void)
     cpm_abort();
 }
 
+void report_stats(void)
+{
+    unsigned long ms;
+
+    /* how long the whole operation took */
+    if(verbose && timer_clock != TIMER_CLOCK_NONE){
+        ms = timer_elapsed_ms();
+        printf("Elapsed time %ld.%02ld seconds\n", ms / 1000, (ms % 1000) / 10);
+    }
+#ifndef Z180DMA_ONLY
+    /* how the bank switched block reads and copies to RAM were done */
+    if(verbose && access != ACCESS_Z180DMA)
+        printf("Block copies: %ld bytes by BIOS, %ld bytes by bank switching\n",
+                bankswitch_bios_bytes, bankswitch_ldir_bytes);
+#endif
+}
+
 void abort_and_solicit_report(void)
 {
     puts("Please email will@sowerbutts.com if you would like support for your\nsystem added to this program.");
@@ -130,11 +450,18 @@ unsigned long flashrom_sector_address(unsigned int sector)
     return flashrom_sector_size * ((unsigned long)sector);
 }
 
-void flashrom_wait_toggle_bit(unsigned long address)
+unsigned long chip_base_address(unsigned long address)
+{
+    return address & (~0x7FFFUL);
+}
+
+void flashrom_wait_toggle_bit(unsigned long address, unsigned long typical_ms)
 {
     unsigned char a, b, matches=0;
+    timer_timeout_t timeout;
 
     /* wait for toggle bit to indicate completion */
+    timer_timeout_start(&timeout, typical_ms * FLASH_TIMEOUT_FACTOR + FLASH_TIMEOUT_MIN_MS);
 
     /* data sheet says two additional reads are required to match 
      * after the first match */
@@ -145,16 +472,19 @@ void flashrom_wait_toggle_bit(unsigned long address)
             matches++;
         else
             matches=0;
+        if(timer_timeout_expired(&timeout)){
+            flashrom_chip_write(chip_base_address(address), 0xF0); /* back to read mode */
+            if(serial)
+                xmodem_cancel();
+            printf("\nFlash memory at 0x%lx did not complete the operation in time.\n", address);
+            cpm_abort();
+        }
     }while(matches < 2);
 }
 
-unsigned long chip_base_address(unsigned long address)
-{
-    return address & (~0x7FFFUL);
-}
-
 void flashrom_chip_erase(unsigned long base_address)
 {
+    console_flush(); /* show what we are waiting for: this can take a while */
     base_address = chip_base_address(base_address);
     flashrom_chip_write(base_address | 0x5555, 0xAA);
     flashrom_chip_write(base_address | 0x2AAA, 0x55);
@@ -162,7 +492,7 @@ void flashrom_chip_erase(unsigned long base_address)
     flashrom_chip_write(base_address | 0x5555, 0xAA);
     flashrom_chip_write(base_address | 0x2AAA, 0x55);
     flashrom_chip_write(base_address | 0x5555, 0x10);
-    flashrom_wait_toggle_bit(base_address);
+    flashrom_wait_toggle_bit(base_address, flashrom_type->chip_erase_ms);
 }
 
 void flashrom_sector_erase(unsigned long address)
@@ -175,7 +505,7 @@ void flashrom_sector_erase(unsigned long address)
     flashrom_chip_write(base_address | 0x5555, 0xAA);
     flashrom_chip_write(base_address | 0x2AAA, 0x55);
     flashrom_chip_write(address, 0x30);
-    flashrom_wait_toggle_bit(address);
+    flashrom_wait_toggle_bit(address, flashrom_type->sector_erase_ms);
 }
 
 /* this is used only for programming atmel 29C parts which have a combined erase/program cycle */
@@ -195,15 +525,7 @@ void flashrom_sector_program(unsigned long address, unsigned char *buffer, unsig
         flashrom_chip_write(prog_address++, *(buffer++));
     }
 
-    flashrom_wait_toggle_bit(address);
-}
-
-void delay10ms(void)
-{
-    unsigned int a, b=0;
-    /* delay for around 10msec (calibrated for ~40 MHz Z180, delay will be longer on slower CPUs) */
-    for(a=0; a<18000; a++)
-        b++;
+    flashrom_wait_toggle_bit(address, flashrom_type->sector_erase_ms);
 }
 
 unsigned int flashrom_read_id_word(unsigned long base_address)
@@ -211,30 +533,87 @@ unsigned int flashrom_read_id_word(unsigned long base_address)
     return ((unsigned int)flashrom_chip_read(base_address) << 8) | flashrom_chip_read(base_address | 0x0001);
 }
 
-unsigned int flashrom_identify_device(unsigned long base_address)
+unsigned long access_max_size(void)
 {
-    unsigned int flashrom_device_id;
+    /* the amount of flash each access method can reach */
+    switch(access){
+        case ACCESS_Z180DMA:
+            return 0x100000UL;   /* Z180 physical address space is 1MB */
+        case ACCESS_UNABIOS:
+            return 0x40000000UL; /* 32768 ROM pages of 32KB */
+        case ACCESS_P112:
+            return 0xFFFFFFFFUL; /* we use only the first 32KB, see below */
+        default:
+            return 0x400000UL;   /* 128 ROM banks of 32KB; bank numbers from 0x80 are RAM */
+    }
+}
 
+void flashrom_enter_id_mode(unsigned long base_address)
+{
     /* put the flash memory into identify mode */
     flashrom_chip_write(base_address | 0x5555, 0xAA);
     flashrom_chip_write(base_address | 0x2AAA, 0x55);
     flashrom_chip_write(base_address | 0x5555, 0x90);
 
     /* atmel 29C parts require a pause for 10msec at this point */
-    delay10ms();
-
-    /* load manufacturer and device IDs */
-    flashrom_device_id = flashrom_read_id_word(base_address);
+    timer_delay_ms(10);
+}
 
+void flashrom_exit_id_mode(unsigned long base_address)
+{
     /* put the flash memory back into read mode */
     flashrom_chip_write(base_address | 0x5555, 0xF0);
 
     /* atmel 29C parts require a pause for 10msec at this point */
-    delay10ms();
+    timer_delay_ms(10);
+}
+
+unsigned int flashrom_identify_device(unsigned long base_address)
+{
+    unsigned int flashrom_device_id;
+
+    flashrom_enter_id_mode(base_address);
+
+    /* load manufacturer and device IDs */
+    flashrom_device_id = flashrom_read_id_word(base_address);
+
+    flashrom_exit_id_mode(base_address);
 
     return flashrom_device_id;
 }
 
+/* true if the chip at base_address also appears at address because the upper
+   address lines are not decoded: what we read there changes when that chip
+   is put into identify mode */
+bool flashrom_mirrored(unsigned long base_address, unsigned long address)
+{
+    unsigned int contents, id_mode_contents;
+
+    contents = flashrom_read_id_word(address);
+    flashrom_enter_id_mode(base_address);
+    id_mode_contents = flashrom_read_id_word(address);
+    flashrom_exit_id_mode(base_address);
+
+    return contents != id_mode_contents;
+}
+
+/* count the chips of the first chip's type fitted one after another */
+unsigned int flashrom_probe_chips(void)
+{
+    unsigned int chip;
+    unsigned long address;
+
+    for(chip=1; chip < MAX_CHIP_COUNT; chip++){
+        address = flashrom_chip_size * chip;
+        if(address + flashrom_chip_size > access_max_size() ||
+                flashrom_mirrored(0, address) ||
+                flashrom_identify_device(address) != flashrom_type->chip_id)
+            break;
+    }
+
+    return chip;
+}
+
 void flashrom_setup(void)
 {
     if(flashrom_type){
@@ -249,6 +628,30 @@ void flashrom_setup(void)
     flashrom_size = flashrom_chip_size * (unsigned long)chip_count;
 }
 
+/* A ROM smaller than the space we assume for it appears there several times
+   over. Find the smallest size at which the whole contents repeat. */
+void flashrom_rom_size(void)
+{
+    unsigned long size, offset, copy;
+
+    for(size = ROM_MIN_SIZE; size < flashrom_chip_size; size <<= 1){
+        for(offset = 0; offset < size; offset += CPM_BLOCK_SIZE){
+            flashrom_block_read(offset, rombuffer, CPM_BLOCK_SIZE);
+            for(copy = offset + size; copy < flashrom_chip_size; copy += size)
+                if(!flashrom_block_verify(copy, rombuffer, CPM_BLOCK_SIZE))
+                    break;
+            if(copy < flashrom_chip_size)
+                break; /* not a copy */
+        }
+        if(offset == size){
+            printf("ROM contents repeat every %ldKB.\n", size >> 10);
+            rom_chip.sector_count = size / flashrom_sector_size;
+            flashrom_setup();
+            return;
+        }
+    }
+}
+
 bool flashrom_identify(void)
 {
     unsigned int flashrom_device_id;
@@ -259,8 +662,6 @@ bool flashrom_identify(void)
     flashrom_mem_contents = flashrom_read_id_word(address);
     flashrom_device_id = flashrom_identify_device(address);
 
-    printf("Flash memory chip ID is 0x%04X: ", flashrom_device_id);
-
     for(flashrom_type = flashrom_chips; flashrom_type->chip_id; flashrom_type++)
         if(flashrom_type->chip_id == flashrom_device_id)
             break;
@@ -268,7 +669,7 @@ bool flashrom_identify(void)
     if(!flashrom_type->chip_id){
         /* we scanned the whole table without finding our chip */
         flashrom_type = NULL;
-        puts("Unknown flash chip.");
+        printf("Flash memory chip ID is 0x%04X: Unknown flash chip.\n", flashrom_device_id);
         /* some boards have jumpers to switch /WE between being tied high or connected to CPU /WR */
         if(flashrom_device_id == flashrom_mem_contents)
             puts("Chip ID matches memory contents: Check ROM's Write Enable pin is connected.");
@@ -276,7 +677,9 @@ bool flashrom_identify(void)
     }
 
     flashrom_setup();
-    printf("%s (%dKB)\n", flashrom_type->chip_name, flashrom_type->sector_size * flashrom_type->sector_count / 8);
+    if(!quiet)
+        printf("Flash memory chip ID is 0x%04X: %s (%ldKB)\n",
+                flashrom_device_id, flashrom_type->chip_name, flashrom_chip_size >> 10);
 
     /* RomWBW reports the number of 32KB ROM banks, allowing us to auto-detect 
        when multiple chips are installed. Do this only if the user has not
@@ -284,8 +687,21 @@ bool flashrom_identify(void)
        cannot report the number of ROM banks. */
     if(rom_bank_count && !chip_count_forced){
         chip = rom_bank_count / (int)(flashrom_chip_size >> 15);
+        if(chip > MAX_CHIP_COUNT)
+            chip = MAX_CHIP_COUNT;
+        if(chip > 1){
+            if(!quiet)
+                printf("BIOS reports %d x 32KB ROM banks: %d chips\n", rom_bank_count, chip);
+            chip_count = chip;
+            flashrom_setup();
+        }
+    }else if(!chip_count_forced && access != ACCESS_Z180DMA && access != ACCESS_P112){
+        /* otherwise look for more chips; the Z180 DMA engine can reach RAM
+           above the flash, which must not be sent flash commands */
+        chip = flashrom_probe_chips();
         if(chip > 1){
-            printf("BIOS reports %d x 32KB ROM banks: %d chips\n", rom_bank_count, chip);
+            if(!quiet)
+                printf("Found %d chips\n", chip);
             chip_count = chip;
             flashrom_setup();
         }
@@ -308,42 +724,164 @@ bool flashrom_identify(void)
     return true;
 }
 
-void flashrom_read(cpm_fcb *outfile)
+void fast_read_begin(void)
+{
+    if(!fast_active)
+        return;
+#ifndef Z180DMA_ONLY
+    if(access == ACCESS_P112){
+        bankswitch_rom_waits = dcntl_fast;
+        return;
+    }
+#endif
+    z180_out0(Z180_DCNTL, dcntl_fast);
+}
+
+void fast_read_end(void)
+{
+    if(!fast_active)
+        return;
+#ifndef Z180DMA_ONLY
+    if(access == ACCESS_P112){
+        bankswitch_rom_waits = dcntl_normal;
+        return;
+    }
+#endif
+    z180_out0(Z180_DCNTL, dcntl_normal);
+}
+
+void fast_read_failed(void)
+{
+    if(!serial_console)
+        puts("\nFlash reads failed with fewer wait states: /FASTREAD turned off.");
+    fast_active = false;
+}
+
+void fast_block_read(unsigned long address, unsigned char *buffer, unsigned int length)
+{
+    fast_read_begin();
+    flashrom_block_read(address, buffer, length);
+    fast_read_end();
+}
+
+/* a mismatch is checked again at the normal wait states */
+bool fast_block_verify(unsigned long address, unsigned char *buffer, unsigned int length)
+{
+    bool match;
+
+    fast_read_begin();
+    match = flashrom_block_verify(address, buffer, length);
+    fast_read_end();
+    if(!match && fast_active && flashrom_block_verify(address, buffer, length)){
+        fast_read_failed();
+        match = true;
+    }
+
+    return match;
+}
+
+bool fast_block_verify_constant(unsigned long address, unsigned char value, unsigned int length)
+{
+    bool match;
+
+    fast_read_begin();
+    match = flashrom_block_verify_constant(address, value, length);
+    fast_read_end();
+    if(!match && fast_active && flashrom_block_verify_constant(address, value, length)){
+        fast_read_failed();
+        match = true;
+    }
+
+    return match;
+}
+
+unsigned long stage_capacity(void)
+{
+#ifndef Z180DMA_ONLY
+    unsigned int bios_bank;
+
+    /* RomWBW keeps its AUX bank just below the BIOS bank and the RAM disk
+       in the banks from the first RAM bank up to the AUX bank */
+    if(access == ACCESS_ROMWBW_26){
+        bios_bank = bankswitch_get_bios_bank();
+        if(bios_bank > BANKSWITCH_RAM_BANK0 + 1)
+            return (unsigned long)(bios_bank - 1 - BANKSWITCH_RAM_BANK0) << 8; /* 256 records to a bank */
+    }
+#endif
+    puts("/STAGE needs RomWBW v2.6 or later with a RAM disk: using the disk instead.");
+    return 0;
+}
+
+void stage_store(unsigned long block, unsigned int count)
+{
+    /* copy filebuffer to the staging area */
+#ifndef Z180DMA_ONLY
+    ram_block_write_bankswitch(BANKSWITCH_RAM_BASE + block * CPM_BLOCK_SIZE, filebuffer, count * CPM_BLOCK_SIZE);
+#endif
+}
+
+void flashrom_read(cpm_fcb *outfile, bool update)
 {
-    unsigned long offset;
-    unsigned int block;
+    unsigned long offset, end, block, file_size = 0, written = 0, source;
+    unsigned int count;
     unsigned char r;
 
-    offset = 0;
+    /* When updating an existing file we compare each record of the file with
+       the flash and write back only those which differ, so an unchanged ROM
+       costs no disk writes at all.                                         */
+    if(update)
+        file_size = cpm_f_getsize(outfile);
+
+    /* With /STAGE the flash is captured to RAM first and the file is then
+       written from there, so flash and disk accesses are not interleaved. */
+    if(stage){
+        end = stage_capacity();
+        if(end > region_length / CPM_BLOCK_SIZE)
+            end = region_length / CPM_BLOCK_SIZE;
+        for(block=0; block < end; block += count){
+            count = (end - block < FILEBUFFER_BLOCKS) ? end - block : FILEBUFFER_BLOCKS;
+            if(!(block & 0xFF))
+                progress("\rCapture %ld/%ldKB ", block >> 3, end >> 3);
+            fast_block_read(region_offset + block * CPM_BLOCK_SIZE, filebuffer, count * CPM_BLOCK_SIZE);
+            stage_store(block, count);
+        }
+        stage_records = end;
+    }
+
+    offset = region_offset;
+    end = region_offset + region_length;
     block = 0;
 
-    while(offset < flashrom_size){
+    while(offset < end){
         if(!(offset & 0x3FF))
-            printf("\rRead %d/%dKB ", (int)(offset >> 10), (int)(flashrom_size >> 10));
-        flashrom_block_read(offset, rombuffer, CPM_BLOCK_SIZE);
-        r = cpm_f_write_random(outfile, block++, rombuffer);
-        if(r){
-            printf("cpm_f_write()=%d\n", r);
-            cpm_abort();
+            progress("\rRead %ld/%ldKB ", (offset - region_offset) >> 10, region_length >> 10);
+        source = (block < stage_records) ? BANKSWITCH_RAM_BASE + block * CPM_BLOCK_SIZE : offset;
+        if(block >= file_size || cpm_f_read_random(outfile, block, filebuffer) ||
+           !fast_block_verify(source, filebuffer, CPM_BLOCK_SIZE)){
+            fast_block_read(source, rombuffer, CPM_BLOCK_SIZE);
+            r = cpm_f_write_random(outfile, block, rombuffer);
+            if(r){
+                printf("cpm_f_write()=%d\n", r);
+                cpm_abort();
+            }
+            written++;
         }
+        block++;
         offset += CPM_BLOCK_SIZE;
     }
 
-    puts("\rRead complete.");
+    if(update)
+        printf("\rRead complete: updated %ld/%ld records.\n", written, block);
+    else
+        puts("\rRead complete.");
 }
 
-bool read_data_from_file(cpm_fcb *infile, unsigned int block, unsigned int count)
+bool read_data_from_file(cpm_fcb *infile, unsigned long block, unsigned int count)
 {
     unsigned char *ptr, r;
 
     ptr = filebuffer;
 
-    /* give the user something pretty to watch */
-    if(!verbose){
-        putchar('\x08');
-        putchar(spinner());
-    }
-
     while(count--){
         r = cpm_f_read_random(infile, block++, ptr);
         switch(r){
@@ -363,18 +901,195 @@ bool read_data_from_file(cpm_fcb *infile, unsigned int block, unsigned int count
     return false; /* not EOF */
 }
 
-unsigned int flashrom_verify_and_write(cpm_fcb *infile, bool perform_write)
+void image_stage(cpm_fcb *infile)
 {
-    unsigned int sector_count, sector=0, block=0, subsector=0, mismatch=0;
-    unsigned int subsectors_per_sector, blocks_per_subsector, bytes_per_subsector;
-    unsigned long flash_address;
-    bool verify_okay;
-    bool eof = false;
+    unsigned long records, size, block;
+    unsigned int count;
+
+    /* one sequential pass over the file; anything that does not fit in RAM
+       is read from disk as usual */
+    records = stage_capacity();
+    if(!records)
+        return;
+    size = cpm_f_getsize(infile);
+    if(records > size)
+        records = size;
+
+    for(block=0; block < records; block += count){
+        count = (records - block < FILEBUFFER_BLOCKS) ? records - block : FILEBUFFER_BLOCKS;
+        if(!(block & 0xFF))
+            progress("\rStage %ld/%ldKB ", block >> 3, records >> 3);
+        if(read_data_from_file(infile, block, count))
+            break;
+        stage_store(block, count);
+        stage_records = block + count;
+    }
+
+    printf("\rStaged %ld/%ldKB of the image in RAM.\n", stage_records >> 3, size >> 3);
+}
+
+bool sector_in_map(unsigned int sector)
+{
+    return (image_map[sector >> 3] & (1 << (sector & 7))) != 0;
+}
+
+bool sector_in_image(unsigned int sector)
+{
+    return image_type == IMAGE_BINARY || image_type == IMAGE_FLASH || (fill_gaps && image_type == IMAGE_HEX) || sector_in_map(sector);
+}
+
+bool chip_in_image(unsigned int chip)
+{
+    unsigned int sector;
+
+    for(sector = chip * flashrom_type->sector_count; sector < (chip+1) * flashrom_type->sector_count; sector++)
+        if(!sector_in_image(sector))
+            return false;
+
+    return true;
+}
+
+unsigned int undo_sector_index(unsigned int sector)
+{
+    unsigned int i;
+    unsigned int index = 0;
+    unsigned char bits;
+
+    /* position of a saved sector in the undo file: count the saved sectors before it */
+    for(i=0; i < (sector >> 3); i++)
+        for(bits = image_map[i]; bits; bits >>= 1)
+            index += bits & 1;
+    for(i = sector & ~7; i < sector; i++)
+        if(sector_in_map(i))
+            index++;
+
+    return index;
+}
+
+/* Read image data for the flash from the start of the region plus "block"
+   128-byte blocks into filebuffer. Returns true at the end of the image. */
+bool image_read(cpm_fcb *infile, unsigned long block, unsigned int count)
+{
+    unsigned long address;
+    unsigned int sector;
+
+    if(image_type == IMAGE_SERIAL){
+        /* serial_receive_sector() has fetched the whole sector already */
+        if(serial_ram)
+            flashrom_block_read(BANKSWITCH_RAM_BASE + (block % flashrom_type->sector_size) * CPM_BLOCK_SIZE,
+                    filebuffer, count * CPM_BLOCK_SIZE);
+        return false;
+    }
+
+    /* give the user something pretty to watch */
+    if(!verbose)
+        spinner();
+
+    if(image_type == IMAGE_BINARY){
+        if(block + count <= stage_records){
+            flashrom_block_read(BANKSWITCH_RAM_BASE + block * CPM_BLOCK_SIZE, filebuffer, count * CPM_BLOCK_SIZE);
+            return false;
+        }
+        return read_data_from_file(infile, block, count);
+    }
+
+    if(image_type == IMAGE_FLASH){
+        fast_block_read(copy_source + block * CPM_BLOCK_SIZE, filebuffer, count * CPM_BLOCK_SIZE);
+        return false;
+    }
+
+    address = ((unsigned long)region_first * flashrom_type->sector_size + block) * CPM_BLOCK_SIZE;
+    sector = address / flashrom_sector_size;
+    if(sector >= image_map_end)
+        return true;
+
+    if(image_type == IMAGE_UNDO){
+        /* the saved sectors follow each other in ascending order */
+        if(read_data_from_file(infile, undo_data_record + (unsigned long)undo_sector_index(sector) * flashrom_type->sector_size
+                                       + block % flashrom_type->sector_size, count))
+            cpm_abort(); /* the file has shrunk since we checked it */
+        return false;
+    }
+
+    if(!sector_in_map(sector))
+        memset(filebuffer, 0xFF, count * CPM_BLOCK_SIZE); /* a gap, with /FILLGAPS */
+    else if(!hex_fill(address, filebuffer, count * CPM_BLOCK_SIZE))
+        cpm_abort(); /* the file has changed since we checked it */
+
+    return false;
+}
 
+void image_cover(unsigned long address, unsigned int length)
+{
+    unsigned long sector, last;
+
+    /* data beyond the flash is rejected by image_scan_hex() */
+    sector = address / flashrom_sector_size;
+    last = (address + length - 1) / flashrom_sector_size;
+    for(; sector <= last && sector < SECTOR_MAP_BYTES * 8; sector++)
+        image_map[sector >> 3] |= (1 << (sector & 7));
+}
+
+bool image_scan_hex(cpm_fcb *infile)
+{
+    unsigned int sector, covered = 0;
+
+    /* Check the whole file and note which sectors it covers. Sectors it
+       does not cover are left alone, unless /FILLGAPS is given in which case
+       they must be blank (just as if the file were converted to a binary
+       image padded with 0xFF). Within a covered sector, bytes not in the
+       file are 0xFF. */
+
+    memset(image_map, 0, SECTOR_MAP_BYTES);
+    hex_open(infile);
+    if(!hex_scan(image_cover))
+        return false;
+
+    if(!hex_bytes){
+        puts("Hex file contains no data.");
+        return false;
+    }
+
+    if(hex_lowest < region_offset || hex_highest >= region_offset + region_length){
+        printf("Hex file data from 0x%06lX to 0x%06lX lies outside the flash ROM region.\n",
+                hex_lowest, hex_highest);
+        return false;
+    }
+
+    image_map_end = fill_gaps ? region_end : hex_highest / flashrom_sector_size + 1;
+
+    for(sector=region_first; sector < region_end; sector++)
+        if(sector_in_image(sector))
+            covered++;
+
+    printf("Hex file: %ld bytes from 0x%06lX to 0x%06lX, %d sectors%s\n",
+            hex_bytes, hex_lowest, hex_highest, covered, fill_gaps ? " with gaps filled" : "");
+
+    return true;
+}
+
+unsigned int count_programmed_bytes(unsigned char *buffer, unsigned int length)
+{
+    unsigned int count = 0;
+
+    /* bytes containing 0xFF are left erased and need not be programmed */
+    while(length--)
+        if(*(buffer++) != 0xFF)
+            count++;
+
+    return count;
+}
+
+bool sector_is_dirty(unsigned int sector)
+{
+    return (sector_map[sector >> 3] & (1 << (sector & 7))) != 0;
+}
+
+void flashrom_setup_subsectors(void)
+{
     /* We verify or program at most one sector at once. If a sector is larger
        than our memory buffer for data read from disk, we divide it up into
-       multiple "subsectors". If a sector already contains the desired data we
-       avoid reprogramming it (thanks to John Coffman for this super idea).    */
+       multiple "subsectors". */
 
     subsectors_per_sector = flashrom_type->sector_size / FILEBUFFER_BLOCKS;
     if(subsectors_per_sector == 0){
@@ -392,136 +1107,1455 @@ unsigned int flashrom_verify_and_write(cpm_fcb *infile, bool perform_write)
     bytes_per_subsector = blocks_per_subsector * CPM_BLOCK_SIZE;
 
     if( ((flashrom_type->strategy & ST_ERASE_CHIP) && flashrom_type->sector_count != 1) ||
-        ((flashrom_type->strategy & ST_PROGRAM_SECTORS) && subsectors_per_sector != 1)){
+        ((flashrom_type->strategy & ST_PROGRAM_SECTORS) && subsectors_per_sector != 1) ||
+        (chip_count * flashrom_type->sector_count > SECTOR_MAP_BYTES * 8)){
         puts("FAILED SANITY CHECKS :(");
         abort_and_solicit_report();
     }
+}
 
-    sector_count = chip_count * flashrom_type->sector_count;
+unsigned int crc16(unsigned int crc, unsigned char *data, unsigned int length)
+{
+    unsigned char bit;
 
-    for(sector=0; (sector < sector_count) && !eof; sector++){
-        printf("%s%s: sector %3d/%d %s", 
-                verbose ? "" : "\r",
-                perform_write ? "Write" : "Verify", 
-                sector, sector_count,
-                verbose ? "" : "  ");
+    /* CRC-16/CCITT */
+    while(length--){
+        crc ^= (unsigned int)(*(data++)) << 8;
+        for(bit=0; bit<8; bit++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
 
-        /* verify sector */
-        flash_address = flashrom_sector_address(sector);
-        block = sector * flashrom_type->sector_size;
-        verify_okay = true;
+    return crc;
+}
 
-        for(subsector=0; subsector < subsectors_per_sector; subsector++){
-            if(read_data_from_file(infile, block, blocks_per_subsector)){
-                eof = true;
-                break;
-            }else if(!flashrom_block_verify(flash_address, filebuffer, bytes_per_subsector)){
-                verify_okay = false;
-                break;
-            }
+/* fewest memory wait states giving a chip of this access time long enough */
+unsigned char z180_read_wait_states(unsigned int access_ns)
+{
+    int cycle_ns, available_ns;
+    unsigned char waits = 0;
+
+    cycle_ns = 1000000UL / timer_cpu_khz;
+    available_ns = cycle_ns + cycle_ns / 2 - Z180_READ_OVERHEAD_NS;
+    while(waits < 3 && available_ns < (int)access_ns){
+        available_ns += cycle_ns;
+        waits++;
+    }
 
-            block += blocks_per_subsector;
-            flash_address += bytes_per_subsector;
-        }
+    return waits;
+}
 
-        if(verbose)
-            printf(verify_okay ? "verified\n" : (perform_write ? "mismatch, " : "FAILED\n"));
+unsigned int fast_read_digest(void)
+{
+    unsigned long address;
+    unsigned int digest = 0;
 
-        if(!verify_okay){
-            mismatch++;
-            if(perform_write){
-                if(subsector){
-                    /* we need to rewind to the first subsector */
-                    flash_address = flashrom_sector_address(sector);
-                    block = sector * flashrom_type->sector_size;
-                    eof = read_data_from_file(infile, block, blocks_per_subsector);
-                    subsector = 0;
-                }
+    for(address = 0; address < FASTREAD_CHECK_BYTES; address += CPM_BLOCK_SIZE * FILEBUFFER_BLOCKS){
+        fast_block_read(address, filebuffer, CPM_BLOCK_SIZE * FILEBUFFER_BLOCKS);
+        digest = crc16(digest, filebuffer, CPM_BLOCK_SIZE * FILEBUFFER_BLOCKS);
+    }
 
-                /* erase and program sector */
-                if(flashrom_type->strategy & ST_PROGRAM_SECTORS){
-                    /* This type of chip has a combined erase/program cycle that programs a whole
-                       sector at once. The sectors are quite small (128 or 256 bytes) so there is
-                       exactly 1 subsector (and we employ a sanity check to ensure this is true).
-                       Additionally we can be sure that we are not at EOF yet. */
-                    flashrom_sector_program(flash_address, filebuffer, bytes_per_subsector);
-                }else{
-                    if(flashrom_type->strategy & ST_ERASE_CHIP){
-                        if(verbose)
-                            printf("chip erase, ");
-                        flashrom_chip_erase(flash_address);
-                    }else{
-                        if(verbose)
-                            printf("sector erase, ");
-                        flashrom_sector_erase(flash_address);
-                    }
-
-                    while(true){
-                        flashrom_block_write(flash_address, filebuffer, bytes_per_subsector);
-                        subsector++;
-                        if(subsector >= subsectors_per_sector)
-                            break;
-                        block += blocks_per_subsector;
-                        flash_address += bytes_per_subsector;
-                        if(read_data_from_file(infile, block, blocks_per_subsector)){
-                            eof = true;
-                            break;
-                        }
-                    }
-
-                    if(verbose)
-                        puts("programmed");
-                }
-            }
-        }
+    return digest;
+}
 
-        /* P112 can address only first 32KB of any device */
-        if(access == ACCESS_P112){
-            if(sector >= ((32768 / 128) / flashrom_type->sector_size))
+/* choose the wait states for /FASTREAD and check the flash reads the same */
+void fast_read_setup(bool z180_io)
+{
+    unsigned char waits, normal_waits, pass;
+    unsigned int digest;
+
+    if(!(access == ACCESS_P112 || z180_io) || !flashrom_type->access_ns ||
+            timer_speed_source == TIMER_SPEED_ASSUMED){
+        puts("/FASTREAD needs a Z180, a known CPU clock and a recognised flash chip.");
+        return;
+    }
+
+    if(access == ACCESS_P112)
+        dcntl_normal = BANKSWITCH_P112_ROM_WAITS;
+    else
+        dcntl_normal = z180_in0(Z180_DCNTL);
+    normal_waits = (dcntl_normal & Z180_DCNTL_MWI) >> 6;
+
+    digest = fast_read_digest();
+    for(waits = z180_read_wait_states(flashrom_type->access_ns); waits < normal_waits; waits++){
+        dcntl_fast = (dcntl_normal & ~Z180_DCNTL_MWI) | (waits << 6);
+        fast_active = true;
+        for(pass=0; pass < FASTREAD_CHECK_PASSES && fast_read_digest() == digest; pass++);
+        if(pass == FASTREAD_CHECK_PASSES)
+            break;
+        fast_active = false;
+    }
+
+    if(fast_active)
+        printf("Flash reads use %d memory wait states instead of %d.\n", waits, normal_waits);
+    else
+        printf("Flash reads need all %d memory wait states.\n", normal_waits);
+}
+
+void checkpoint_prepare(const char *filename)
+{
+    /* the checkpoint lives alongside the image file, with a .CKP extension */
+    cpm_f_prepare(&checkpoint_file, filename);
+    memcpy(checkpoint_file.ext, "CKP", 3);
+}
+
+void checkpoint_flush(void)
+{
+    if(checkpoint_dirty){
+        if(cpm_f_write_random(&checkpoint_file, checkpoint_record, checkpointbuffer)){
+            puts("Cannot update checkpoint file.");
+            cpm_abort();
+        }
+        checkpoint_dirty = false;
+    }
+}
+
+void checkpoint_load(unsigned int record)
+{
+    if(record != checkpoint_record){
+        checkpoint_flush();
+        if(cpm_f_read_random(&checkpoint_file, record, checkpointbuffer))
+            memset(checkpointbuffer, CKPT_DIRTY, CPM_BLOCK_SIZE); /* treat a damaged file as "redo everything" */
+        checkpoint_record = record;
+    }
+}
+
+unsigned char checkpoint_get_state(unsigned int sector)
+{
+    checkpoint_load(1 + (sector >> 7));
+    return checkpointbuffer[sector & 0x7F];
+}
+
+void checkpoint_set_state(unsigned int sector, unsigned char state)
+{
+    checkpoint_load(1 + (sector >> 7));
+    if(checkpointbuffer[sector & 0x7F] != state){
+        checkpointbuffer[sector & 0x7F] = state;
+        checkpoint_dirty = true;
+    }
+}
+
+unsigned int image_full_digest(cpm_fcb *infile)
+{
+    unsigned int sector, subsector, digest = 0;
+    unsigned long block;
+
+    /* digest of every record of the image, read as the compare pass reads
+       it: an image which differs anywhere is not taken for the same one */
+    for(sector=region_first; sector < image_end; sector++){
+        if(!sector_in_image(sector))
+            continue;
+        progress("\rCheck image: sector %3d/%d  ", sector, image_end);
+        block = (unsigned long)(sector - region_first) * flashrom_type->sector_size;
+        for(subsector=0; subsector < subsectors_per_sector; subsector++){
+            if(image_read(infile, block, blocks_per_subsector))
+                return digest;
+            digest = crc16(digest, filebuffer, bytes_per_subsector);
+            block += blocks_per_subsector;
+        }
+    }
+
+    return digest;
+}
+
+/* the image_end the compare pass would find for this image */
+unsigned int image_current_end(cpm_fcb *infile)
+{
+    unsigned long end;
+
+    if(image_type != IMAGE_BINARY)
+        return image_map_end;
+
+    end = region_first + (cpm_f_getsize(infile) + flashrom_type->sector_size - 1) / flashrom_type->sector_size;
+    if(end > region_end)
+        end = region_end;
+    /* P112 can address only first 32KB of any device (see flashrom_compare) */
+    if(access == ACCESS_P112 && end > (32768 / 128) / flashrom_type->sector_size + 1)
+        end = (32768 / 128) / flashrom_type->sector_size + 1;
+
+    return end;
+}
+
+void checkpoint_fill_header(cpm_fcb *infile)
+{
+    checkpoint_header_t *header = (checkpoint_header_t*)checkpointbuffer;
+
+    memset(checkpointbuffer, 0, CPM_BLOCK_SIZE);
+    header->magic = CHECKPOINT_MAGIC;
+    header->chip_id = flashrom_type->chip_id;
+    header->sector_count = chip_count * flashrom_type->sector_count;
+    header->region_first = region_first;
+    header->image_end = image_end;
+    header->image_size = cpm_f_getsize(infile);
+    header->image_digest = image_digest;
+}
+
+void checkpoint_finish(bool complete)
+{
+    if(!checkpoint_active)
+        return;
+
+    checkpoint_flush();
+    cpm_f_close(&checkpoint_file);
+    if(complete)
+        cpm_f_delete(&checkpoint_file);
+    checkpoint_active = false;
+}
+
+bool checkpoint_resume(cpm_fcb *infile)
+{
+    checkpoint_header_t header;
+    unsigned int sector, sector_count, remaining = 0;
+    unsigned char state;
+
+    if(cpm_f_open(&checkpoint_file))
+        return false; /* no checkpoint: normal write */
+
+    sector_count = chip_count * flashrom_type->sector_count;
+    checkpoint_active = true;
+    checkpoint_dirty = false;
+    checkpoint_record = 0xFFFF;
+
+    if(cpm_f_read_random(&checkpoint_file, 0, checkpointbuffer) == 0){
+        memcpy(&header, checkpointbuffer, sizeof(header));
+        image_end = image_current_end(infile);
+        image_digest = header.image_digest; /* checked below, by reading the image */
+        checkpoint_fill_header(infile); /* current values, for comparison */
+        if(memcmp(&header, checkpointbuffer, sizeof(header)) == 0 &&
+           image_full_digest(infile) == header.image_digest){
+            /* same image and chips: rebuild the sector map from the recorded states */
+            memset(sector_map, 0, SECTOR_MAP_BYTES);
+            memset(chip_plan, 0, sizeof(chip_plan));
+            for(sector=0; sector < sector_count; sector++){
+                state = checkpoint_get_state(sector);
+                if(state != CKPT_CLEAN && state != CKPT_VERIFIED){
+                    sector_map[sector >> 3] |= (1 << (sector & 7));
+                    remaining++;
+                }
+            }
+            printf("\rResuming interrupted write: %d sectors to complete.\n", remaining);
+            return true;
+        }
+    }
+
+    puts("\rIgnoring checkpoint file from a different image.");
+    checkpoint_finish(true);
+    return false;
+}
+
+void checkpoint_create(cpm_fcb *infile)
+{
+    unsigned int sector, sector_count, record, i;
+    unsigned char state;
+
+    sector_count = chip_count * flashrom_type->sector_count;
+
+    cpm_f_delete(&checkpoint_file);
+    if(cpm_f_create(&checkpoint_file)){
+        puts("Cannot create checkpoint file: write will not be resumable.");
+        return;
+    }
+
+    checkpoint_fill_header(infile);
+    cpm_f_write_random(&checkpoint_file, 0, checkpointbuffer);
+
+    /* every sector we may erase starts out dirty, including clean sectors
+       that a chip erase will wipe along with the rest of the chip */
+    for(record=0; record <= (sector_count - 1) >> 7; record++){
+        for(i=0; i < CPM_BLOCK_SIZE; i++){
+            sector = (record << 7) + i;
+            state = CKPT_CLEAN;
+            if(sector < sector_count &&
+               (sector_is_dirty(sector) || chip_plan[sector / flashrom_type->sector_count].chip_erase))
+                state = CKPT_DIRTY;
+            checkpointbuffer[i] = state;
+        }
+        cpm_f_write_random(&checkpoint_file, 1 + record, checkpointbuffer);
+    }
+
+    /* close and reopen to commit the directory entry before we touch the flash */
+    cpm_f_close(&checkpoint_file);
+    cpm_f_open(&checkpoint_file);
+    checkpoint_active = true;
+    checkpoint_dirty = false;
+    checkpoint_record = 0xFFFF;
+}
+
+void undo_prepare(const char *filename)
+{
+    /* the undo file lives alongside the image file, with a .UND extension */
+    cpm_f_prepare(&undo_file, filename);
+    memcpy(undo_file.ext, "UND", 3);
+}
+
+bool undo_create(void)
+{
+    undo_header_t header;
+    unsigned int *list = (unsigned int*)checkpointbuffer;
+    unsigned int sector, sector_count, subsector, block;
+    unsigned long record, flash_address;
+
+    /* Save the current contents of the sectors the write will change. A chip
+       erase wipes the unchanged sectors of the chip too, but those are then
+       programmed with the same data from the image, so the changed sectors
+       are all that ROLLBACK needs. The backup costs disk writes in proportion
+       to the size of the change, not the size of the flash.              */
+
+    sector_count = chip_count * flashrom_type->sector_count;
+    memset(&header, 0, sizeof(header));
+    header.magic = UNDO_MAGIC;
+    header.chip_id = flashrom_type->chip_id;
+    header.sector_count = sector_count;
+    header.sector_size = flashrom_type->sector_size;
+
+    cpm_f_delete(&undo_file);
+    if(cpm_f_create(&undo_file))
+        return false;
+
+    /* the list of saved sectors */
+    record = 1;
+    memset(checkpointbuffer, 0, CPM_BLOCK_SIZE);
+    for(sector=0; sector < sector_count; sector++){
+        if(!sector_is_dirty(sector))
+            continue;
+        list[header.saved_sectors % UNDO_SECTORS_PER_RECORD] = sector;
+        header.saved_sectors++;
+        if((header.saved_sectors % UNDO_SECTORS_PER_RECORD) == 0){
+            if(cpm_f_write_random(&undo_file, record++, checkpointbuffer))
+                return false;
+            memset(checkpointbuffer, 0, CPM_BLOCK_SIZE);
+        }
+    }
+    if((header.saved_sectors % UNDO_SECTORS_PER_RECORD) && cpm_f_write_random(&undo_file, record++, checkpointbuffer))
+        return false;
+
+    /* followed by their contents */
+    for(sector=0; sector < sector_count; sector++){
+        if(!sector_is_dirty(sector))
+            continue;
+
+        progress("%sBackup: sector %3d/%d %s", 
+                verbose ? "" : "\r",
+                sector, sector_count,
+                verbose ? "saved\n" : "  ");
+
+        flash_address = flashrom_sector_address(sector);
+        for(subsector=0; subsector < subsectors_per_sector; subsector++){
+            fast_block_read(flash_address, filebuffer, bytes_per_subsector);
+            header.saved_digest = crc16(header.saved_digest, filebuffer, bytes_per_subsector);
+            for(block=0; block < blocks_per_subsector; block++)
+                if(cpm_f_write_random(&undo_file, record++, filebuffer + block * CPM_BLOCK_SIZE))
+                    return false;
+            flash_address += bytes_per_subsector;
+        }
+    }
+
+    /* the header goes last, so a file cut short by a full disk is never valid */
+    memset(checkpointbuffer, 0, CPM_BLOCK_SIZE);
+    memcpy(checkpointbuffer, &header, sizeof(header));
+    if(cpm_f_write_random(&undo_file, 0, checkpointbuffer))
+        return false;
+
+    /* close to commit the directory entry before we touch the flash */
+    if(cpm_f_close(&undo_file))
+        return false;
+
+    printf("\rUndo file: saved %d sectors.\n", header.saved_sectors);
+
+    return true;
+}
+
+bool undo_load(cpm_fcb *infile)
+{
+    undo_header_t header;
+    unsigned int *list = (unsigned int*)checkpointbuffer;
+    unsigned int i, sector, digest = 0;
+    unsigned long record, records;
+
+    /* Rebuild the map of saved sectors from the undo file and check the saved
+       contents against their digest before we trust them with the flash. */
+
+    flashrom_setup_subsectors();
+
+    if(cpm_f_read_random(infile, 0, checkpointbuffer)){
+        puts("Undo file is empty.");
+        return false;
+    }
+    memcpy(&header, checkpointbuffer, sizeof(header));
+
+    if(header.magic != UNDO_MAGIC){
+        puts("Not an undo file.");
+        return false;
+    }
+
+    if(header.chip_id != flashrom_type->chip_id ||
+       header.sector_count != chip_count * flashrom_type->sector_count ||
+       header.sector_size != flashrom_type->sector_size){
+        puts("Undo file was saved from a different flash ROM.");
+        return false;
+    }
+
+    memset(image_map, 0, SECTOR_MAP_BYTES);
+    image_map_end = 0;
+    for(i=0; i < header.saved_sectors; i++){
+        if((i % UNDO_SECTORS_PER_RECORD) == 0 &&
+           cpm_f_read_random(infile, 1 + i / UNDO_SECTORS_PER_RECORD, checkpointbuffer))
+            break;
+        sector = list[i % UNDO_SECTORS_PER_RECORD];
+        if(sector >= header.sector_count || sector < image_map_end)
+            break;
+        image_map[sector >> 3] |= (1 << (sector & 7));
+        image_map_end = sector + 1;
+    }
+
+    undo_data_record = 1 + (header.saved_sectors + UNDO_SECTORS_PER_RECORD - 1) / UNDO_SECTORS_PER_RECORD;
+    records = (unsigned long)header.saved_sectors * flashrom_type->sector_size;
+
+    if(i == header.saved_sectors && i){
+        for(record=0; record < records; record += blocks_per_subsector){
+            if(!(record & 0xFF))
+                progress("\rCheck undo file %ld/%ldKB ", record >> 3, records >> 3);
+            if(read_data_from_file(infile, undo_data_record + record, blocks_per_subsector))
+                break;
+            digest = crc16(digest, filebuffer, bytes_per_subsector);
+        }
+        if(record >= records && digest == header.saved_digest){
+            printf("\rUndo file: %d sectors to restore.\n", header.saved_sectors);
+            return true;
+        }
+    }
+
+    puts("\rUndo file is damaged.");
+    return false;
+}
+
+unsigned int flashrom_compare(cpm_fcb *infile, bool perform_write)
+{
+    unsigned int sector_count, sector=0, subsector=0, mismatch=0, checked=0;
+    unsigned int programmed;
+    unsigned long block;
+    unsigned long flash_address, read_start;
+    chip_plan_t *plan;
+    bool verify_okay;
+    bool eof = false;
+
+    /* Compare every sector of the flash with the image file, recording the
+       sectors that differ in sector_map. When we are going to write, we read
+       the whole of each sector (even after a mismatch) so that we can count the
+       bytes that will need to be programmed for the write plan.               */
+
+    sector_count = chip_count * flashrom_type->sector_count;
+    if(!targeted_verify){
+        image_end = (image_type == IMAGE_BINARY || image_type == IMAGE_FLASH) ? region_end : image_map_end;
+        image_digest = 0;
+        memset(sector_map, 0, SECTOR_MAP_BYTES);
+        memset(chip_plan, 0, sizeof(chip_plan));
+        compare_read_ms = 0;
+        compare_read_records = 0;
+    }
+
+    for(sector=region_first; (sector < region_end) && !eof; sector++){
+        /* after a write we verify only the sectors it could not verify itself */
+        if(targeted_verify && !sector_is_dirty(sector))
+            continue;
+        if(!sector_in_image(sector))
+            continue; /* not in the hex file: leave it alone */
+        checked++;
+
+        progress("%s%s: sector %3d/%d %s", 
+                verbose ? "" : "\r",
+                perform_write ? "Compare" : "Verify", 
+                sector, sector_count,
+                verbose ? "" : "  ");
+
+        flash_address = flashrom_sector_address(sector);
+        block = (unsigned long)(sector - region_first) * flashrom_type->sector_size;
+        plan = &chip_plan[sector / flashrom_type->sector_count];
+        verify_okay = true;
+        programmed = 0;
+
+        for(subsector=0; subsector < subsectors_per_sector; subsector++){
+            read_start = timer_elapsed_ms();
+            eof = image_read(infile, block, blocks_per_subsector);
+            compare_read_ms += timer_elapsed_ms() - read_start;
+            if(eof){
+                if(subsector == 0) /* this sector is not part of the image */
+                    image_end = sector;
+                else
+                    image_end = sector + 1;
+                break;
+            }
+
+            compare_read_records += blocks_per_subsector;
+            image_digest = crc16(image_digest, filebuffer, bytes_per_subsector);
+
+            if(verify_okay && !fast_block_verify(flash_address, filebuffer, bytes_per_subsector)){
+                verify_okay = false;
+                if(!perform_write)
+                    break;
+            }
+
+            if(perform_write)
+                programmed += count_programmed_bytes(filebuffer, bytes_per_subsector);
+
+            block += blocks_per_subsector;
+            flash_address += bytes_per_subsector;
+        }
+
+        if(verbose)
+            printf(verify_okay ? "verified\n" : (perform_write ? "mismatch\n" : "FAILED\n"));
+
+        plan->image_bytes += programmed;
+        if(!verify_okay){
+            mismatch++;
+            sector_map[sector >> 3] |= (1 << (sector & 7));
+            plan->dirty_sectors++;
+            plan->dirty_bytes += programmed;
+        }
+
+        if(checkpoint_active && !verify_okay)
+            checkpoint_set_state(sector, CKPT_DIRTY);
+
+        /* P112 can address only first 32KB of any device */
+        if(access == ACCESS_P112){
+            if(sector >= ((32768 / 128) / flashrom_type->sector_size)){
                 eof = true; /* force EOF at end of addressable region */
+                image_end = sector + 1;
+            }
+        }
+    }
+
+    if(checkpoint_active)
+        checkpoint_flush();
+
+    if(!perform_write){
+        /* report outcome */
+        if(targeted_verify)
+            printf("\rVerify (%d reprogrammed sectors)", checked);
+        else if(image_type == IMAGE_HEX || image_type == IMAGE_UNDO)
+            printf("\rVerify (%d sectors in %s file)", checked, image_type == IMAGE_HEX ? "hex" : "undo");
+        else if(sector != region_end)
+            printf("\rPartial verify (%d/%d sectors)", sector-1-region_first, region_end-region_first);
+        else
+            printf("\rVerify (%d sectors)", region_end-region_first);
+
+        if(mismatch){
+            printf(" complete: %d sectors contain errors.\n" \
+                   "\n*** VERIFY FAILED ***\n\n", 
+                   mismatch);
+        }else
+            puts(" complete: OK!");
+    }
+
+    return mismatch;
+}
+
+unsigned long flashrom_program_ms(unsigned long bytes)
+{
+    return (bytes * flashrom_type->program_us) / 1000;
+}
+
+void flashrom_print_sector_map(unsigned int chip)
+{
+    unsigned int sector, first;
+
+    /* one character per sector: '*' will be reprogrammed, '.' is unchanged,
+       '-' is not in the hex file */
+    first = chip * flashrom_type->sector_count;
+    for(sector=0; sector < flashrom_type->sector_count; sector++){
+        if((sector & 63) == 0)
+            printf("\n  %06lX ", flashrom_sector_address(first + sector));
+        putchar(sector_is_dirty(first + sector) ? '*' : (sector_in_image(first + sector) ? '.' : '-'));
+    }
+    putchar('\n');
+}
+
+unsigned long flashrom_plan_write(void)
+{
+    unsigned int chip, erase_ops, total_erase_ops = 0;
+    unsigned long sector_cost, chip_cost, total = 0;
+    unsigned long program_bytes, total_program_bytes = 0, records = 0, read_ms, read_rate;
+    chip_plan_t *plan;
+
+    /* For each chip choose the cheapest way to get the new data in place:
+       either erase and program only the mismatched sectors, or erase the whole
+       chip at once and then program every byte of the image that is not 0xFF.
+       The chip erase is considered only when the image covers the whole chip,
+       otherwise we would destroy data beyond the end of the image (or in the
+       gaps of a hex file).                                                   */
+
+    for(chip=0; chip < chip_count; chip++){
+        plan = &chip_plan[chip];
+        plan->complete = (region_first <= chip * flashrom_type->sector_count) &&
+                         (image_end >= (chip+1) * flashrom_type->sector_count) && chip_in_image(chip);
+        erase_ops = 0;
+        program_bytes = 0;
+
+        if(plan->dirty_sectors){
+            sector_cost = (unsigned long)plan->dirty_sectors * flashrom_type->sector_erase_ms;
+            program_bytes = plan->dirty_bytes;
+            if(flashrom_type->strategy & ST_PROGRAM_SECTORS){
+                /* combined erase/program cycle; there is no alternative plan */
+                total += sector_cost;
+            }else{
+                sector_cost += flashrom_program_ms(plan->dirty_bytes);
+                chip_cost = flashrom_type->chip_erase_ms + flashrom_program_ms(plan->image_bytes);
+
+                if((flashrom_type->strategy & ST_ERASE_CHIP) || (plan->complete && chip_cost < sector_cost)){
+                    plan->chip_erase = true;
+                    program_bytes = plan->image_bytes;
+                    erase_ops = 1;
+                    total += chip_cost;
+                }else{
+                    erase_ops = plan->dirty_sectors;
+                    total += sector_cost;
+                }
+            }
+            /* records read from disk again to program the sectors */
+            records += (unsigned long)(plan->chip_erase ? flashrom_type->sector_count : plan->dirty_sectors)
+                       * flashrom_type->sector_size;
+        }
+
+        total_erase_ops += erase_ops;
+        total_program_bytes += program_bytes;
+
+        if(plan_only || (plan->dirty_sectors && !quiet && (verbose || chip_count > 1)))
+            printf("Chip %d: %d sectors changed, %s erase, program %ld bytes\n",
+                    chip+1, plan->dirty_sectors, plan->chip_erase ? "chip" : "sector", program_bytes);
+        if(plan_only)
+            flashrom_print_sector_map(chip);
+    }
+
+    if(plan_only){
+        printf("\nErase operations: %d\nBytes to program: %ld\n", total_erase_ops, total_program_bytes);
+        /* the write itself compares the whole image before programming, and
+           again afterwards only with /FULLVERIFY (otherwise just the sectors
+           that failed to verify); a hex file is read in proportion to its
+           size instead */
+        records += (full_verify ? 2 : 1) * (unsigned long)(image_end - region_first) * flashrom_type->sector_size;
+        if(image_type == IMAGE_BINARY)
+            printf("Disk records to read: %ld\n", records);
+    }
+
+    if(plan_only || !quiet)
+        printf("Estimated %s time %ld.%02ld seconds\n", plan_only ? "erase/program" : "write",
+                total / 1000, (total % 1000) / 10);
+
+    /* the image is read at the rate the compare pass measured */
+    if(plan_only && timer_clock != TIMER_CLOCK_NONE && compare_read_ms){
+        read_rate = compare_read_records * 1000 / compare_read_ms; /* records per second */
+        read_ms = read_rate ? records * 1000 / read_rate : 0;
+        printf("Image read rate %ld records per second: estimated read time %ld.%02ld seconds\n"
+               "Estimated total time %ld.%02ld seconds\n",
+                read_rate, read_ms / 1000, (read_ms % 1000) / 10,
+                (total + read_ms) / 1000, ((total + read_ms) % 1000) / 10);
+    }
+
+    return total;
+}
+
+unsigned char flashrom_program_sector(cpm_fcb *infile, unsigned int sector, bool erase)
+{
+    unsigned int subsector;
+    unsigned long flash_address, block;
+
+    /* each subsector is verified as soon as it is programmed, while its data
+       is still in our buffer, so there is no need to read it from disk again */
+
+    flash_address = flashrom_sector_address(sector);
+    block = (unsigned long)(sector - region_first) * flashrom_type->sector_size;
+
+    if(image_read(infile, block, blocks_per_subsector))
+        return PROGRAM_EOF;
+
+    if(flashrom_type->strategy & ST_PROGRAM_SECTORS){
+        /* This type of chip has a combined erase/program cycle that programs a whole
+           sector at once. The sectors are quite small (128 or 256 bytes) so there is
+           exactly 1 subsector (and we employ a sanity check to ensure this is true). */
+        flashrom_sector_program(flash_address, filebuffer, bytes_per_subsector);
+        if(!fast_block_verify(flash_address, filebuffer, bytes_per_subsector))
+            return PROGRAM_FAILED;
+        return PROGRAM_OK;
+    }
+
+    if(erase){
+        if(flashrom_type->strategy & ST_ERASE_CHIP){
+            if(verbose)
+                printf("chip erase, ");
+            flashrom_chip_erase(flash_address);
+        }else{
+            if(verbose)
+                printf("sector erase, ");
+            flashrom_sector_erase(flash_address);
+        }
+        if(checkpoint_active){
+            checkpoint_set_state(sector, CKPT_ERASED);
+            checkpoint_flush();
+        }
+    }
+
+    subsector = 0;
+    while(true){
+        flashrom_block_write(flash_address, filebuffer, bytes_per_subsector);
+        if(!fast_block_verify(flash_address, filebuffer, bytes_per_subsector))
+            return PROGRAM_FAILED;
+        subsector++;
+        if(subsector >= subsectors_per_sector)
+            break;
+        block += blocks_per_subsector;
+        flash_address += bytes_per_subsector;
+        if(image_read(infile, block, blocks_per_subsector))
+            return PROGRAM_EOF;
+    }
+
+    return PROGRAM_OK;
+}
+
+unsigned int count_dirty_sectors(void)
+{
+    unsigned int sector, sector_count, count = 0;
+
+    sector_count = chip_count * flashrom_type->sector_count;
+    for(sector=0; sector < sector_count; sector++)
+        if(sector_is_dirty(sector))
+            count++;
+
+    return count;
+}
+
+unsigned int flashrom_verify_and_write(cpm_fcb *infile, bool perform_write)
+{
+    unsigned int sector, sector_count, mismatch, programmed = 0, failed = 0, chip_sector;
+    unsigned char attempt, result;
+    chip_plan_t *plan;
+
+    /* If a sector already contains the desired data we avoid reprogramming it
+       (thanks to John Coffman for this super idea). We first compare the whole
+       image to build a map of the sectors that differ, then plan and execute
+       the cheapest way to erase and program them. Progress is recorded in a
+       checkpoint file so an interrupted write can pick up where it left off.
+
+       Each sector is verified as it is programmed and removed from the map;
+       whatever is left in the map afterwards (sectors that failed, or every
+       sector written under /FULLVERIFY) is verified again by the caller. The
+       number of such sectors is returned.                                  */
+
+    flashrom_setup_subsectors();
+
+    /* COPY has no image file to keep a checkpoint beside */
+    if(perform_write && !plan_only && image_type != IMAGE_FLASH && checkpoint_resume(infile)){
+        resumed = true;
+        mismatch = 1;
+    }else{
+        mismatch = flashrom_compare(infile, perform_write);
+        if(!perform_write)
+            return mismatch;
+    }
+
+    sector_count = chip_count * flashrom_type->sector_count;
+
+    if(plan_only){
+        printf("\rWrite plan: %d/%d sectors differ\n", mismatch, sector_count);
+        flashrom_plan_write();
+        return mismatch;
+    }
+
+    if(mismatch){
+        if(!resumed){
+            flashrom_plan_write();
+            /* an interrupted write keeps the undo file it made at the start */
+            if(undo && !undo_create()){
+                cpm_f_close(&undo_file);
+                cpm_f_delete(&undo_file);
+                puts("\rCannot write undo file: flash ROM not modified.");
+                cpm_abort();
+            }
+            if(image_type != IMAGE_FLASH)
+                checkpoint_create(infile);
+        }
+
+        for(sector=region_first; sector < image_end; sector++){
+            plan = &chip_plan[sector / flashrom_type->sector_count];
+            if(!plan->chip_erase && !sector_is_dirty(sector))
+                continue;
+
+            progress("%sWrite: sector %3d/%d %s", 
+                    verbose ? "" : "\r",
+                    sector, sector_count,
+                    verbose ? "" : "  ");
+
+            if(plan->chip_erase && (sector % flashrom_type->sector_count) == 0){
+                if(verbose)
+                    printf("chip erase, ");
+                flashrom_chip_erase(flashrom_sector_address(sector));
+                if(checkpoint_active){
+                    for(chip_sector=0; chip_sector < flashrom_type->sector_count; chip_sector++)
+                        checkpoint_set_state(sector + chip_sector, CKPT_ERASED);
+                    checkpoint_flush();
+                }
+            }
+
+            programmed++;
+            for(attempt=1; ; attempt++){
+                /* a sector which fails to verify is erased and programmed again */
+                result = flashrom_program_sector(infile, sector, !plan->chip_erase || attempt > 1);
+                if(result != PROGRAM_FAILED || attempt >= WRITE_ATTEMPTS)
+                    break;
+                printf(verbose ? "verify failed, retrying, " : "\rSector %d failed to verify, retrying\n", sector);
+            }
+
+            if(result == PROGRAM_FAILED){
+                failed++;
+                sector_map[sector >> 3] |= (1 << (sector & 7)); /* leave it for the final verify */
+                if(checkpoint_active)
+                    checkpoint_set_state(sector, CKPT_DIRTY);
+                if(verbose)
+                    puts("FAILED");
+            }else if(result == PROGRAM_EOF){
+                /* the image ended part way through the sector, so the rest of
+                   it was never compared: leave it for the final verify */
+                sector_map[sector >> 3] |= (1 << (sector & 7));
+                if(checkpoint_active)
+                    checkpoint_set_state(sector, CKPT_DIRTY);
+                if(verbose)
+                    puts("programmed to end of image");
+            }else{
+                if(!full_verify)
+                    sector_map[sector >> 3] &= ~(1 << (sector & 7));
+                if(checkpoint_active)
+                    checkpoint_set_state(sector, CKPT_VERIFIED);
+                if(verbose)
+                    puts("programmed, verified");
+            }
+
+            if(checkpoint_active)
+                checkpoint_flush();
+
+            if(result == PROGRAM_EOF)
+                break;
+        }
+    }
+
+    printf("\rWrite complete: Reprogrammed %d/%d sectors", programmed, sector_count);
+    if(failed)
+        printf(", %d failed to verify", failed);
+    puts(".");
+
+    /* verify only what we could not verify while programming, unless asked for everything */
+    targeted_verify = !full_verify;
+
+    return count_dirty_sectors();
+}
+
+unsigned int flashrom_blank_check(void)
+{
+    unsigned int sector, sector_count, subsector, mismatch = 0;
+    unsigned long flash_address;
+    bool blank;
+
+    /* Check that every sector in the region is erased (all 0xFF), recording
+       the sectors that are not in sector_map. The access method compares the
+       flash against the constant directly so no disk I/O is required.      */
+
+    flashrom_setup_subsectors();
+    sector_count = chip_count * flashrom_type->sector_count;
+    memset(sector_map, 0, SECTOR_MAP_BYTES);
+    memset(chip_plan, 0, sizeof(chip_plan));
+
+    for(sector=region_first; sector < region_end; sector++){
+        progress("%sBlank check: sector %3d/%d %s", 
+                verbose ? "" : "\r",
+                sector, sector_count,
+                verbose ? "" : "  ");
+
+        flash_address = flashrom_sector_address(sector);
+        blank = true;
+        for(subsector=0; subsector < subsectors_per_sector; subsector++){
+            if(!fast_block_verify_constant(flash_address, 0xFF, bytes_per_subsector)){
+                blank = false;
+                break;
+            }
+            flash_address += bytes_per_subsector;
+        }
+
+        if(verbose)
+            puts(blank ? "blank" : "not blank");
+
+        if(!blank){
+            mismatch++;
+            sector_map[sector >> 3] |= (1 << (sector & 7));
+            chip_plan[sector / flashrom_type->sector_count].dirty_sectors++;
+        }
+
+        /* P112 can address only first 32KB of any device */
+        if(access == ACCESS_P112 && sector >= ((32768 / 128) / flashrom_type->sector_size))
+            break;
+    }
+
+    printf("\rBlank check (%d sectors) complete: ", region_end-region_first);
+    if(mismatch)
+        printf("%d sectors are not blank.\n", mismatch);
+    else
+        puts("OK, all erased.");
+
+    return mismatch;
+}
+
+unsigned int flashrom_erase(void)
+{
+    unsigned int chip, sector, first, last, erased = 0, sector_count;
+    chip_plan_t *plan;
+
+    /* Erase only the sectors which the blank check found to be programmed. A
+       chip lying wholly inside the region is erased in one operation instead
+       when that is quicker than erasing its dirty sectors one at a time.    */
+
+    if(!flashrom_blank_check())
+        return 0;
+
+    sector_count = chip_count * flashrom_type->sector_count;
+
+    for(chip=0; chip < chip_count; chip++){
+        plan = &chip_plan[chip];
+        if(!plan->dirty_sectors)
+            continue;
+
+        first = chip * flashrom_type->sector_count;
+        last = first + flashrom_type->sector_count;
+
+        if(!(flashrom_type->strategy & ST_PROGRAM_SECTORS) &&
+           region_first <= first && region_end >= last &&
+           ((flashrom_type->strategy & ST_ERASE_CHIP) ||
+            flashrom_type->chip_erase_ms < (unsigned long)plan->dirty_sectors * flashrom_type->sector_erase_ms)){
+            if(!quiet)
+                printf("%sErase: chip %d %s", verbose ? "" : "\r", chip+1, verbose ? "chip erase\n" : "  ");
+            flashrom_chip_erase(flashrom_sector_address(first));
+            erased += plan->dirty_sectors;
+            continue;
+        }
+
+        for(sector=first; sector < last; sector++){
+            if(!sector_is_dirty(sector))
+                continue;
+            progress("%sErase: sector %3d/%d %s", 
+                    verbose ? "" : "\r",
+                    sector, sector_count,
+                    verbose ? "sector erase\n" : "  ");
+            if(flashrom_type->strategy & ST_PROGRAM_SECTORS){
+                /* no erase command; program the sector with 0xFF instead */
+                memset(filebuffer, 0xFF, bytes_per_subsector);
+                flashrom_sector_program(flashrom_sector_address(sector), filebuffer, bytes_per_subsector);
+            }else
+                flashrom_sector_erase(flashrom_sector_address(sector));
+            erased++;
+        }
+    }
+
+    printf("\rErase complete: Erased %d/%d sectors.\n", erased, sector_count);
+
+    return flashrom_blank_check();
+}
+
+void flashrom_copy(void)
+{
+    unsigned int mismatch;
+
+    /* COPY treats another part of the flash as the image for the region, so
+       the usual compare, plan, erase, program and verify steps apply with
+       the data coming straight from the flash instead of from disk. The
+       source must not overlap the region, which would change under us.  */
+
+    if((copy_source % flashrom_sector_size) || copy_source > flashrom_size - region_length ||
+       (copy_source < region_offset + region_length && region_offset < copy_source + region_length)){
+        puts("/FROM must be a multiple of the sector size, and the source must lie within\n" \
+             "the flash ROM and not overlap the region set by /OFFSET and /LENGTH.");
+        return;
+    }
+
+    printf("Copy 0x%06lX to 0x%06lX (%ldKB)\n", copy_source, region_offset, region_length >> 10);
+    image_type = IMAGE_FLASH;
+
+    mismatch = flashrom_verify_and_write(NULL, true);
+    if(plan_only){
+        puts("Plan only: flash ROM not modified.");
+        return;
+    }
+    if(mismatch)
+        flashrom_verify_and_write(NULL, false);
+}
+
+bool check_file_size(cpm_fcb *imagefile, bool allow_partial)
+{
+    unsigned long file_size;
+    unsigned long rom_size;
+
+    file_size = cpm_f_getsize(imagefile);
+    rom_size = (unsigned long)(region_end - region_first) * flashrom_type->sector_size;
+
+    if(file_size == rom_size)
+        return true;
+
+    if(allow_partial &&
+       (rom_size > file_size) && 
+       (file_size != 0) &&
+       (file_size & 0xff) == 0) /* file is exact multiple of 32KB long */
+        return true;
+
+    return false;
+}
+
+/* blocks of the region to compare in the first pass: up to the end of the
+   longest image still matching */
+unsigned long verify_images_end(unsigned char count)
+{
+    unsigned long end = 0;
+    unsigned char i;
+
+    for(i=0; i<count; i++)
+        if(verify_images[i].exact && verify_images[i].blocks > end)
+            end = verify_images[i].blocks;
+
+    return end;
+}
+
+/* count the sectors of an image which differ from the flash, from the
+   sector holding block "from" onwards; stop once there are more than "limit" */
+void verify_image_count(verify_image_t *image, unsigned long from, unsigned int limit)
+{
+    unsigned long block, sector_end;
+    unsigned int count;
+
+    block = from - from % flashrom_type->sector_size;
+    while(block < image->blocks){
+        sector_end = block + flashrom_type->sector_size;
+        if(sector_end > image->blocks)
+            sector_end = image->blocks;
+        for(; block < sector_end; block += count){
+            count = (sector_end - block < FILEBUFFER_BLOCKS) ? sector_end - block : FILEBUFFER_BLOCKS;
+            if(read_data_from_file(&image->file, block, count))
+                return; /* the file has shrunk since we checked it */
+            if(!fast_block_verify(region_offset + block * CPM_BLOCK_SIZE, filebuffer, count * CPM_BLOCK_SIZE)){
+                if(++image->differ > limit)
+                    return;
+                break; /* on to the next sector */
+            }
+        }
+        block = sector_end;
+    }
+
+    image->counted = true;
+}
+
+bool flashrom_verify_images(const char **filenames, unsigned char count, bool allow_partial)
+{
+    verify_image_t *image, *closest = NULL;
+    unsigned long block, end, region_blocks;
+    unsigned int chunk, length;
+    unsigned char i, j, next, exact = 0, tried = 0;
+    bool differ;
+    unsigned char *flash = filebuffer + VERIFY_CHUNK_BLOCKS * CPM_BLOCK_SIZE;
+
+    /* Find which of several images the flash holds. Each chunk of the flash
+       is read once and compared with every image that has matched so far;
+       an image is dropped at its first difference, and we stop reading once
+       none is left. If no image matches, the closest is found by counting
+       the sectors that differ, taking each image on from where it was
+       dropped and giving up on it once it is further off than the closest
+       so far. */
+
+    region_blocks = region_length / CPM_BLOCK_SIZE;
+    for(i=0; i<count; i++){
+        image = &verify_images[i];
+        memset(image, 0, sizeof(verify_image_t));
+        image->filename = filenames[i];
+        cpm_f_prepare(&image->file, filenames[i]);
+        if(hex_image_file(&image->file)){
+            printf("\"%s\": VERIFY with several images takes binary image files only.\n", filenames[i]);
+            return false;
+        }
+        if(cpm_f_open(&image->file)){
+            printf("Cannot open file \"%s\".\n", filenames[i]);
+            return false;
+        }
+        if(!check_file_size(&image->file, allow_partial)){
+            printf("\"%s\": image file size does not match ROM size (see /PARTIAL).\n", filenames[i]);
+            continue;
+        }
+        image->blocks = cpm_f_getsize(&image->file);
+        if(image->blocks > region_blocks)
+            image->blocks = region_blocks;
+        image->exact = true;
+        exact++;
+    }
+
+    if(!quiet)
+        printf("Verify against %d images\n", count);
+
+    for(block=0; block < (end = verify_images_end(count)); block += chunk){
+        if(!(block & 0xFF))
+            progress("\rVerify %ld/%ldKB ", block >> 3, end >> 3);
+        chunk = (end - block < VERIFY_CHUNK_BLOCKS) ? end - block : VERIFY_CHUNK_BLOCKS;
+        fast_block_read(region_offset + block * CPM_BLOCK_SIZE, flash, chunk * CPM_BLOCK_SIZE);
+
+        for(i=0; i<count; i++){
+            image = &verify_images[i];
+            if(!image->exact || block >= image->blocks)
+                continue;
+            length = ((image->blocks - block < chunk) ? image->blocks - block : chunk) * CPM_BLOCK_SIZE;
+            differ = read_data_from_file(&image->file, block, length / CPM_BLOCK_SIZE);
+            if(!differ && memcmp(filebuffer, flash, length)){
+                /* a mismatch is checked again at the normal wait states, and
+                   the chunk read again at them if the fast read was wrong */
+                if(fast_active && flashrom_block_verify(region_offset + block * CPM_BLOCK_SIZE, filebuffer, length)){
+                    fast_read_failed();
+                    flashrom_block_read(region_offset + block * CPM_BLOCK_SIZE, flash, chunk * CPM_BLOCK_SIZE);
+                }else
+                    differ = true;
+            }
+            if(differ){
+                image->exact = false;
+                image->resume = block;
+                exact--;
+            }
+        }
+    }
+
+    if(exact){
+        for(i=0; i<count; i++)
+            if(verify_images[i].exact)
+                printf("\rFlash matches \"%s\".\n", verify_images[i].filename);
+    }else{
+        /* the images which matched for longest are likely the closest, so
+           count those first to set a tight limit for the rest */
+        for(i=0; i<count; i++){
+            image = NULL;
+            for(j=0; j<count; j++)
+                if(verify_images[j].blocks && !(tried & (1 << j)) &&
+                   (!image || verify_images[j].resume > image->resume)){
+                    image = &verify_images[j];
+                    next = j;
+                }
+            if(!image)
+                break;
+            tried |= 1 << next;
+            progress("\rCount %d/%d ", i+1, count);
+            verify_image_count(image, image->resume, closest ? closest->differ : 0xFFFF);
+            if(image->counted && (!closest || image->differ < closest->differ))
+                closest = image;
+        }
+        if(closest)
+            printf("\rNo image matches; closest is \"%s\" with %d sector%s different.\n",
+                    closest->filename, closest->differ, closest->differ == 1 ? "" : "s");
+        else
+            puts("\rNo image matches.");
+    }
+
+    if(verbose){
+        for(i=0; i<count; i++){
+            image = &verify_images[i];
+            printf("  %-14s ", image->filename);
+            if(!image->blocks)
+                puts("wrong size");
+            else if(image->exact)
+                puts("matches");
+            else if(image->counted)
+                printf("%d sectors differ\n", image->differ);
+            else if(image->differ)
+                printf("more than %d sectors differ\n", image->differ - 1);
+            else
+                printf("differs at 0x%06lX\n", region_offset + image->resume * CPM_BLOCK_SIZE);
         }
     }
 
-    /* report outcome */
+    for(i=0; i<count; i++)
+        cpm_f_close(&verify_images[i].file);
+
+    if(!exact)
+        puts("\n*** VERIFY FAILED ***\n");
+
+    return exact != 0;
+}
+
+/* a serial transfer has failed: say why and give up */
+void serial_abort(void)
+{
+    printf("\n%s\n", xmodem_error);
+    cpm_abort();
+}
+
+/* Receive the next sector of a serial transfer into filebuffer or, with
+   serial_ram, into the RAM disk banks. The part of a sector the transfer
+   does not cover is filled with 0xFF and serial_short is set. False once
+   the transfer has ended. */
+bool serial_receive_sector(void)
+{
+    unsigned int block, count, length, received;
+
+    for(block=0; block < flashrom_type->sector_size; block += count){
+        count = (flashrom_type->sector_size - block < FILEBUFFER_BLOCKS) ? flashrom_type->sector_size - block : FILEBUFFER_BLOCKS;
+        length = count * CPM_BLOCK_SIZE;
+        received = xmodem_receive(filebuffer, length);
+        if(xmodem_error)
+            serial_abort();
+        if(!received && !block)
+            return false;
+        if(received < length)
+            serial_short = true;
+        memset(filebuffer + received, 0xFF, length - received);
+        if(serial_ram)
+            stage_store(block, count);
+    }
+
+    return true;
+}
+
+unsigned int flashrom_serial_write(bool perform_write, bool allow_partial)
+{
+    unsigned int sector, end, subsector, sector_count, checked = 0, programmed = 0, mismatch = 0;
+    unsigned long block, flash_address;
+    unsigned char attempt, result;
+    bool match, written, short_transfer;
+
+    /* The image arrives in order and cannot be read twice, so rather than
+       comparing the whole image before writing (see flashrom_verify_and_write)
+       we compare each sector as soon as it has arrived and erase, program and
+       verify it there and then if it differs. The sender waits for us to
+       acknowledge each packet, which holds it off while we do so.          */
+
+    flashrom_setup_subsectors();
+    sector_count = chip_count * flashrom_type->sector_count;
+    end = region_first + region_length / flashrom_sector_size;
+    serial_short = false;
+
+    if(!xmodem_receive_start())
+        serial_abort();
+
+    /* YMODEM gives the size up front, which we check as we would a file's */
+    if(xmodem_size && xmodem_size != region_length &&
+       !(allow_partial && xmodem_size < region_length && (xmodem_size & 0x7FFF) == 0)){
+        xmodem_cancel();
+        printf("\nImage size %ld bytes does not match the %ldKB of flash: Aborting\n" \
+               "You may use /PARTIAL to program only the start of the ROM from an image of\n" \
+               "exactly a multiple of 32KB.\n", xmodem_size, region_length >> 10);
+        return 1;
+    }
+
+    for(sector=region_first; sector < end; sector++){
+        if(!serial_receive_sector())
+            break;
+        /* without /PARTIAL a sector the image ends part way through is not written */
+        if(serial_short && !allow_partial)
+            break;
+        checked++;
+
+        if(!serial_console)
+            progress("%s%s: sector %3d/%d %s",
+                    verbose ? "" : "\r",
+                    perform_write ? "Write" : "Verify",
+                    sector, sector_count,
+                    verbose ? "" : "  ");
+
+        flash_address = flashrom_sector_address(sector);
+        block = (unsigned long)(sector - region_first) * flashrom_type->sector_size;
+        match = true;
+        written = false;
+
+        for(subsector=0; match && subsector < subsectors_per_sector; subsector++){
+            image_read(NULL, block, blocks_per_subsector);
+            match = fast_block_verify(flash_address, filebuffer, bytes_per_subsector);
+            block += blocks_per_subsector;
+            flash_address += bytes_per_subsector;
+        }
+
+        if(!match && perform_write){
+            programmed++;
+            written = true;
+            for(attempt=1; ; attempt++){
+                result = flashrom_program_sector(NULL, sector, true);
+                if(result != PROGRAM_FAILED || attempt >= WRITE_ATTEMPTS)
+                    break;
+            }
+            match = (result != PROGRAM_FAILED);
+        }
+
+        if(!match)
+            mismatch++;
+        if(verbose)
+            puts(!match ? "FAILED" : (written ? "programmed, verified" : "verified"));
+    }
+
+    /* without /PARTIAL an image shorter than the flash is a failure, as a
+       short image file would be, though the sectors before it are written */
+    short_transfer = (sector < end && !allow_partial);
+
+    /* anything beyond the region is not ours to take */
+    if(!xmodem_receive_end())
+        printf("\n%s", xmodem_error);
+    else if(short_transfer)
+        printf("\nTransfer ended after %ldKB, short of the %ldKB of flash (see /PARTIAL).\n",
+                (unsigned long)(sector - region_first) * flashrom_sector_size >> 10, region_length >> 10);
+
     if(perform_write){
-        printf("\rWrite complete: Reprogrammed %d/%d sectors.\n", mismatch, sector_count);
+        printf("\rWrite %s: Reprogrammed %d/%d sectors", short_transfer ? "incomplete" : "complete",
+                programmed, sector_count);
+        if(mismatch)
+            printf(", %d failed to verify", mismatch);
+        puts(".");
+        if(mismatch || short_transfer)
+            puts("\n*** WRITE FAILED ***\n");
     }else{
-        if(sector != sector_count)
-            printf("\rPartial verify (%d/%d sectors)", sector-1, sector_count);
+        printf("\rVerify (%d sectors) %s: ", checked, short_transfer ? "incomplete" : "complete");
+        if(mismatch)
+            printf("%d sectors contain errors.\n\n*** VERIFY FAILED ***\n\n", mismatch);
+        else if(short_transfer)
+            puts("image too short.\n\n*** VERIFY FAILED ***\n");
         else
-            printf("\rVerify (%d sectors)", sector_count);
+            puts("OK!");
+    }
 
-        if(mismatch){
-            printf(" complete: %d sectors contain errors.\n" \
-                   "\n*** VERIFY FAILED ***\n\n", 
-                   mismatch);
-        }else
-            puts(" complete: OK!");
+    return short_transfer ? mismatch + 1 : mismatch;
+}
+
+void flashrom_serial_read(const char *name)
+{
+    unsigned long offset, end;
+    unsigned int count;
+
+    if(!xmodem_send_start(name, region_length, serial == SERIAL_YMODEM))
+        serial_abort();
+
+    end = region_offset + region_length;
+    for(offset=region_offset; offset < end; offset += count){
+        if(!serial_console && !(offset & 0x3FFF))
+            progress("\rRead %ld/%ldKB ", (offset - region_offset) >> 10, region_length >> 10);
+        count = (end - offset < CPM_BLOCK_SIZE * FILEBUFFER_BLOCKS) ? end - offset : CPM_BLOCK_SIZE * FILEBUFFER_BLOCKS;
+        fast_block_read(offset, filebuffer, count);
+        if(!xmodem_send(filebuffer, count))
+            serial_abort();
     }
 
-    return mismatch;
+    if(!xmodem_send_end())
+        serial_abort();
+    puts("\rRead complete.");
 }
 
-bool check_file_size(cpm_fcb *imagefile, bool allow_partial)
+/* READ, VERIFY or WRITE with the image on the far end of a serial line */
+void serial_transfer(const char *filename, bool allow_partial, bool update)
 {
-    unsigned int file_size;
-    unsigned int rom_size;
+    const char *name;
+    bool was_verbose;
 
-    file_size = cpm_f_getsize(imagefile);
-    rom_size = flashrom_type->sector_count * flashrom_type->sector_size * chip_count;
+    if(action != ACTION_READ && action != ACTION_VERIFY && action != ACTION_WRITE){
+        puts("/XMODEM and /YMODEM work with READ, VERIFY and WRITE only.");
+        return;
+    }
+    if(undo || plan_only || full_verify || update){
+        puts("/UNDO, /PLAN, /FULLVERIFY and /UPDATE need an image file.");
+        return;
+    }
+    if(xmodem_unit != XMODEM_CONSOLE && access != ACCESS_ROMWBW_26){
+        puts("Transfers through an HBIOS unit need RomWBW v2.6 or later: leave out the\n" \
+             "unit number to use the console.");
+        return;
+    }
 
-    if(file_size == rom_size)
-        return true;
+    /* a sector must be held whole until we know whether to erase it */
+    if(action != ACTION_READ && flashrom_type->sector_size > FILEBUFFER_BLOCKS){
+        if(!stage){
+            printf("Sectors of %ldKB are held in the RAM disk banks during a transfer: add /STAGE\n" \
+                   "(RomWBW v2.6 or later) to allow this.\n", flashrom_sector_size >> 10);
+            return;
+        }
+        if(stage_capacity() < flashrom_type->sector_size){
+            puts("The RAM disk banks cannot hold a whole sector.");
+            return;
+        }
+        serial_ram = true;
+    }
 
-    if(allow_partial &&
-       (rom_size > file_size) && 
-       (file_size != 0) &&
-       (file_size & 0xff) == 0) /* file is exact multiple of 32KB long */
+    image_type = IMAGE_SERIAL;
+    serial_console = (xmodem_unit == XMODEM_CONSOLE);
+    was_verbose = verbose;
+    if(serial_console)
+        verbose = false; /* /V output would go out on the line in the middle of the transfer */
+
+    if(action == ACTION_READ){
+        name = filename ? filename : SERIAL_DEFAULT_NAME;
+        if(name[0] && name[1] == ':')
+            name += 2; /* no drive letter */
+        printf("Start the %s receive now.\n", serial == SERIAL_YMODEM ? "YMODEM" : "XMODEM");
+        flashrom_serial_read(name);
+    }else{
+        puts("Start the XMODEM or YMODEM send now.");
+        flashrom_serial_write(action == ACTION_WRITE, allow_partial);
+    }
+
+    serial_console = false;
+    verbose = was_verbose;
+}
+
+bool flashrom_setup_region(bool region_forced)
+{
+    unsigned long alignment;
+
+    if(!region_forced){
+        /* whole flash; note the P112 may limit us to less than this (see flashrom_compare) */
+        region_length = flashrom_size;
+        region_first = 0;
+        region_end = chip_count * flashrom_type->sector_count;
         return true;
+    }
 
-    return false;
+    /* WRITE and VERIFY work with whole sectors, READ with 128-byte blocks */
+    alignment = (action == ACTION_READ) ? CPM_BLOCK_SIZE : flashrom_sector_size;
+
+    if(region_offset >= flashrom_size)
+        return false;
+    if(!region_length)
+        region_length = flashrom_size - region_offset;
+    if((region_offset % alignment) || (region_length % alignment) || (region_length > flashrom_size - region_offset))
+        return false;
+
+    region_first = region_offset / flashrom_sector_size;
+    region_end = (region_offset + region_length + flashrom_sector_size - 1) / flashrom_sector_size;
+
+    printf("Region 0x%06lX to 0x%06lX (%ldKB)\n", region_offset, region_offset + region_length - 1,
+            region_length >> 10);
+
+    return true;
+}
+
+bool parse_number(const char *text, unsigned long *value)
+{
+    unsigned long result = 0;
+    unsigned char base = 10, digit;
+
+    /* decimal, or hex with a 0x prefix, optionally followed by K for KB */
+    if(text[0] == '0' && (text[1] == 'X' || text[1] == 'x')){
+        base = 16;
+        text += 2;
+    }
+
+    if(!*text)
+        return false;
+
+    for(; *text; text++){
+        if(*text >= '0' && *text <= '9')
+            digit = *text - '0';
+        else if(base == 16 && *text >= 'A' && *text <= 'F')
+            digit = *text - 'A' + 10;
+        else if(*text == 'K' && text[1] == 0){
+            result <<= 10;
+            break;
+        }else
+            return false;
+        result = result * base + digit;
+    }
+
+    *value = result;
+    return true;
 }
 
+#ifndef ACCESS_ONLY
 bool una_bios_present(void)
 {
     unsigned int **bios_signature = (unsigned int **)BIOS_SIGNATURE_ADDR;
@@ -542,43 +2576,309 @@ bool old_romwbw_bios_present(void)
 static const char *bpbios_p112_signature = "B/P-DX";
 bool bpbios_p112_present(void)
 {
-    return (memcmp((const char*)(*((unsigned int*)BIOS_ENTRY_ADDR) + 0x75), bpbios_p112_signature, 6) == 0);
+    return (memcmp(*((const char**)BIOS_ENTRY_ADDR) + 0x75, bpbios_p112_signature, 6) == 0);
 }
 
-access_t access_auto_select(void)
+/* methods in the order auto-detection tries them */
+static const access_t access_order[] = {
+    ACCESS_UNABIOS, ACCESS_P112, ACCESS_ROMWBW_26, ACCESS_ROMWBW_OLD, ACCESS_Z180DMA, ACCESS_NONE
+};
+
+/* true if the method can safely be used on this machine */
+bool access_present(access_t method)
 {
     // Note that versions of RomWBW before approx 2014-08 place a
     // signature at CPM_SIGNATURE_ADDR but not BIOS_SIGNATURE_ADDR.
     // Therefore we cannot rely on the latter to confirm if RomWBW
     // HBIOS is present or not.
-    if(una_bios_present())
-        return ACCESS_UNABIOS;
+    switch(method){
+        case ACCESS_UNABIOS:
+            return una_bios_present();
+        case ACCESS_P112:
+            return bpbios_p112_present();
+        case ACCESS_ROMWBW_26:
+            return romwbw_bios_present();
+        case ACCESS_ROMWBW_OLD: /* v2.6 keeps the old signature but not the old entry points */
+            return old_romwbw_bios_present() && !romwbw_bios_present();
+        case ACCESS_Z180DMA: /* the P112 does not have its ROM where the DMA engine expects it */
+            return detect_z180_cpu() && !bpbios_p112_present();
+        default:
+            return false;
+    }
+}
 
-    if(bpbios_p112_present())
-        return ACCESS_P112;
+/* the method a previous BENCH /SAVE found fastest, or ACCESS_NONE */
+access_t access_preferred(void)
+{
+    cpm_fcb prefs_file;
+    prefs_t *prefs = (prefs_t*)rombuffer;
+    bool found;
+
+    cpm_f_prepare(&prefs_file, PREFS_FILENAME);
+    if(cpm_f_open(&prefs_file))
+        return ACCESS_NONE;
+    found = cpm_f_read_random(&prefs_file, 0, rombuffer) == 0 && prefs->magic == PREFS_MAGIC;
+    cpm_f_close(&prefs_file);
+
+    return found ? prefs->access : ACCESS_NONE;
+}
 
-    if(romwbw_bios_present()) // important to check this before old_romwbw_bios_present()
-        return ACCESS_ROMWBW_26;
+access_t access_auto_select(void)
+{
+    access_t method;
+    unsigned char i;
 
-    if(old_romwbw_bios_present())
-        return ACCESS_ROMWBW_OLD;
+    method = access_preferred();
+    if(method != ACCESS_NONE && access_present(method)){
+        if(verbose)
+            puts("Access method chosen by BENCH /SAVE (" PREFS_FILENAME ").");
+        return method;
+    }
 
-    if(detect_z180_cpu())
-        return ACCESS_Z180DMA;
+    for(i=0; access_order[i] != ACCESS_NONE; i++)
+        if(access_present(access_order[i]))
+            return access_order[i];
 
     return ACCESS_NONE;
 }
 
+void access_save_preferred(access_t method)
+{
+    cpm_fcb prefs_file;
+    prefs_t *prefs = (prefs_t*)rombuffer;
+
+    memset(rombuffer, 0, CPM_BLOCK_SIZE);
+    prefs->magic = PREFS_MAGIC;
+    prefs->access = method;
+
+    cpm_f_prepare(&prefs_file, PREFS_FILENAME);
+    cpm_f_delete(&prefs_file);
+    if(cpm_f_create(&prefs_file) || cpm_f_write_random(&prefs_file, 0, rombuffer) || cpm_f_close(&prefs_file))
+        puts("Cannot write " PREFS_FILENAME ".");
+    else
+        printf("Saved to " PREFS_FILENAME ": auto-detection will use %s.\n", access_names[method]);
+}
+#endif
+
+/* select the flash access functions for the method in access and set it up;
+   false if it cannot be used */
+bool access_setup(bool announce)
+{
+#ifndef ACCESS_ONLY
+    // assume bank switching
+    flashrom_chip_read    = flashrom_chip_read_bankswitch;
+    flashrom_chip_write   = flashrom_chip_write_bankswitch;
+    flashrom_block_read   = flashrom_block_read_bankswitch;
+    flashrom_block_write  = flashrom_block_write_bankswitch;
+    flashrom_block_verify = flashrom_block_verify_bankswitch;
+    flashrom_block_verify_constant = flashrom_block_verify_constant_bankswitch;
+#endif
+
+    if(announce && access != ACCESS_NONE && access != ACCESS_AUTO)
+        printf("Using %s.\n", access_names[access]);
+
+    switch(access){
+#if !defined(ACCESS_ONLY) || defined(Z180DMA_ONLY)
+        case ACCESS_Z180DMA:
+            if(chip_count != 1){
+                puts("Z180 DMA engine supports programming a single device only.");
+                return false;
+            }
+            init_z180dma();
+#ifndef Z180DMA_ONLY
+            flashrom_chip_read    = flashrom_chip_read_z180dma;
+            flashrom_chip_write   = flashrom_chip_write_z180dma;
+            flashrom_block_read   = flashrom_block_read_z180dma;
+            flashrom_block_write  = flashrom_block_write_z180dma;
+            flashrom_block_verify = flashrom_block_verify_z180dma;
+            flashrom_block_verify_constant = flashrom_block_verify_constant_z180dma;
+#endif
+            break;
+#endif
+#ifndef Z180DMA_ONLY
+        case ACCESS_UNABIOS:
+            init_bankswitch(BANKSWITCH_UNABIOS);
+            break;
+        case ACCESS_ROMWBW_OLD:
+            init_bankswitch(BANKSWITCH_ROMWBW_OLD);
+            break;
+        case ACCESS_ROMWBW_26:
+            init_bankswitch(BANKSWITCH_ROMWBW_26);
+            break;
+        case ACCESS_P112:
+            init_bankswitch(BANKSWITCH_P112);
+            break;
+        case ACCESS_N8VEM_SBC:
+            init_bankswitch(BANKSWITCH_N8VEM_SBC);
+            break;
+#endif
+        case ACCESS_NONE:
+        case ACCESS_AUTO:
+            puts("Cannot determine how to access your flash ROM chip.");
+            abort_and_solicit_report();
+        default:
+            break;
+    }
+
+    return true;
+}
+
+/* bytes (or toggle bit polls) per second through the current access method */
+unsigned long bench_rate(unsigned char test, unsigned long bench_ms)
+{
+    unsigned long start, ms, count = 0, address = 0;
+    unsigned char i;
+
+    if(test == BENCH_VERIFY)
+        flashrom_block_read(0, filebuffer, BENCH_CHUNK);
+
+    start = timer_elapsed_ms();
+    do{
+        switch(test){
+            case BENCH_READ:
+                flashrom_block_read(address, filebuffer, BENCH_CHUNK);
+                address = (address + BENCH_CHUNK) % BENCH_REGION;
+                count += BENCH_CHUNK;
+                break;
+            case BENCH_VERIFY:
+                flashrom_block_verify(0, filebuffer, BENCH_CHUNK);
+                count += BENCH_CHUNK;
+                break;
+            default:
+                /* the reads flashrom_wait_toggle_bit() makes */
+                for(i=0; i<BENCH_POLLS; i++){
+                    flashrom_chip_read(0);
+                    flashrom_chip_read(0);
+                }
+                count += BENCH_POLLS;
+                break;
+        }
+        ms = timer_elapsed_ms() - start;
+    }while(ms < bench_ms);
+
+    return count * 1000 / ms;
+}
+
+/* CP/M file throughput in bytes per second, through a scratch file */
+void bench_disk(unsigned long bench_ms, unsigned long *write_rate, unsigned long *read_rate)
+{
+    cpm_fcb benchfile;
+    unsigned int record, records = 0;
+    unsigned long start, ms;
+
+    *write_rate = *read_rate = 0;
+    memset(filebuffer, 0xE5, CPM_BLOCK_SIZE);
+    cpm_f_prepare(&benchfile, BENCH_FILENAME);
+    cpm_f_delete(&benchfile);
+    if(cpm_f_create(&benchfile)){
+        puts("Cannot create " BENCH_FILENAME ": disk not tested.");
+        return;
+    }
+
+    start = timer_elapsed_ms();
+    do{
+        if(cpm_f_write_random(&benchfile, records, filebuffer))
+            break; /* disk full */
+        records++;
+        ms = timer_elapsed_ms() - start;
+    }while(ms < bench_ms && records < BENCH_DISK_RECORDS);
+    cpm_f_close(&benchfile);
+    ms = timer_elapsed_ms() - start;
+    *write_rate = (unsigned long)records * CPM_BLOCK_SIZE * 1000 / (ms ? ms : 1);
+
+    if(!cpm_f_open(&benchfile)){
+        start = timer_elapsed_ms();
+        for(record=0; record<records; record++)
+            if(cpm_f_read_random(&benchfile, record, filebuffer))
+                break;
+        ms = timer_elapsed_ms() - start;
+        *read_rate = (unsigned long)record * CPM_BLOCK_SIZE * 1000 / (ms ? ms : 1);
+        cpm_f_close(&benchfile);
+    }
+    cpm_f_delete(&benchfile);
+}
+
+/* time each access method available, or just the one given on the command line */
+void flashrom_bench(bool access_forced, bool save)
+{
+    access_t methods[MAX_BENCH_METHODS], fastest = ACCESS_NONE;
+    unsigned long bench_ms, rate[3], score, best_score = 0, write_rate, read_rate;
+    unsigned int chip_id, method_id;
+    unsigned char i, count = 0;
+
+    if(timer_clock == TIMER_CLOCK_NONE){
+        puts("BENCH needs a clock: RomWBW with interrupts enabled, or CP/M 3.");
+        return;
+    }
+    bench_ms = (timer_clock == TIMER_CLOCK_CPM3) ? BENCH_MS_COARSE : BENCH_MS;
+
+    methods[count++] = access;
+#ifndef ACCESS_ONLY
+    if(!access_forced)
+        for(i=0; access_order[i] != ACCESS_NONE; i++)
+            if(access_order[i] != access && access_present(access_order[i]))
+                methods[count++] = access_order[i];
+#endif
+
+    chip_id = flashrom_identify_device(0);
+    puts("\nAccess method                      Read KB/s  Verify KB/s  Polls/s");
+    for(i=0; i<count; i++){
+        access = methods[i];
+        if(!access_setup(false))
+            continue;
+        printf("%-34s ", access_names[access]);
+        /* a method which cannot see the chip is no use */
+        method_id = flashrom_identify_device(0);
+        if(method_id != chip_id){
+            printf("sees chip ID 0x%04X, not 0x%04X\n", method_id, chip_id);
+            continue;
+        }
+        rate[BENCH_READ] = bench_rate(BENCH_READ, bench_ms);
+        rate[BENCH_VERIFY] = bench_rate(BENCH_VERIFY, bench_ms);
+        rate[BENCH_POLL] = bench_rate(BENCH_POLL, bench_ms);
+        printf("%9ld  %11ld  %7ld\n", rate[BENCH_READ] >> 10, rate[BENCH_VERIFY] >> 10, rate[BENCH_POLL]);
+        /* WRITE spends most of its flash time reading and comparing */
+        score = rate[BENCH_READ] / 2 + rate[BENCH_VERIFY] / 2;
+        if(score > best_score){
+            best_score = score;
+            fastest = access;
+        }
+    }
+
+    bench_disk(bench_ms, &write_rate, &read_rate);
+    printf("CP/M file write %ld KB/s, read %ld KB/s\n", write_rate >> 10, read_rate >> 10);
+
+    if(fastest == ACCESS_NONE)
+        return;
+    if(count > 1)
+        printf("Fastest access method: %s\n", access_names[fastest]);
+#ifndef ACCESS_ONLY
+    if(save)
+        access_save_preferred(fastest);
+#else
+    if(save)
+        puts("This build has a fixed access method: nothing to save.");
+#endif
+}
+
 void main(int argc, const char *argv[]) CALLING
 {
     int i;
     unsigned int mismatch;
     cpm_fcb imagefile;
     const char *filename = NULL;
+    const char *filenames[MAX_VERIFY_IMAGES];
+    unsigned char filename_count = 0;
     bool allow_partial=false;
     bool rom_mode=false;
-
-    puts("FLASH4 by Will Sowerbutts <will@sowerbutts.com> version 1.3.9\n");
+    bool region_forced=false;
+    bool update=false;
+    bool copy_forced=false;
+    bool access_forced=true;
+    bool z180_io;
+    bool save=false;
+    unsigned long irq_limit=BANKSWITCH_DEFAULT_IRQ_LIMIT;
+    unsigned long serial_unit;
 
     /* determine access mode */
     for(i=1; i<argc; i++){ /* check for manual mode override */
@@ -598,9 +2898,48 @@ void main(int argc, const char *argv[]) CALLING
             rom_mode = true;
         else if(strcmp(argv[i], "/V") == 0)
             verbose = true;
+        else if(strcmp(argv[i], "/Q") == 0)
+            quiet = true;
         else if(strcmp(argv[i], "/P") == 0 || strcmp(argv[i], "/PARTIAL") == 0)
             allow_partial = true;
-        else if(argv[i][0] == '/' && argv[i][1] >= '1' && argv[i][1] <= '9'){
+        else if(strcmp(argv[i], "/PLAN") == 0)
+            plan_only = true;
+        else if(strcmp(argv[i], "/FULLVERIFY") == 0)
+            full_verify = true;
+        else if(strcmp(argv[i], "/UPDATE") == 0)
+            update = true;
+        else if(strcmp(argv[i], "/FILLGAPS") == 0)
+            fill_gaps = true;
+        else if(strcmp(argv[i], "/UNDO") == 0)
+            undo = true;
+        else if(strcmp(argv[i], "/STAGE") == 0)
+            stage = true;
+        else if(strcmp(argv[i], "/NOBIOSCOPY") == 0)
+            bios_copy = false;
+        else if(strcmp(argv[i], "/SAVE") == 0)
+            save = true;
+        else if(strcmp(argv[i], "/FASTREAD") == 0)
+            fast_read = true;
+        else if(strncmp(argv[i], "/OFFSET=", 8) == 0 && parse_number(argv[i]+8, &region_offset))
+            region_forced = true;
+        else if(strncmp(argv[i], "/LENGTH=", 8) == 0 && parse_number(argv[i]+8, &region_length) && region_length)
+            region_forced = true;
+        else if(strncmp(argv[i], "/FROM=", 6) == 0 && parse_number(argv[i]+6, &copy_source))
+            copy_forced = true;
+        else if(strncmp(argv[i], "/XMODEM", 7) == 0 || strncmp(argv[i], "/YMODEM", 7) == 0){
+            serial = (argv[i][1] == 'X') ? SERIAL_XMODEM : SERIAL_YMODEM;
+            if(argv[i][7] == '=' && parse_number(argv[i]+8, &serial_unit) && serial_unit < XMODEM_CONSOLE)
+                xmodem_unit = serial_unit;
+            else if(argv[i][7]){
+                printf("Unrecognised option \"%s\"\n", argv[i]);
+                help();
+            }
+        }else if(strncmp(argv[i], "/IRQMAX=", 8) == 0){
+            if(!parse_number(argv[i]+8, &irq_limit) || irq_limit > 0xFFFF){
+                printf("Interrupt limit must be 0 to 65535us: \"%s\"\n", argv[i]);
+                help();
+            }
+        }else if(argv[i][0] == '/' && argv[i][1] >= '1' && argv[i][1] <= '9'){
             chip_count = argv[i][1] - '0';
             chip_count_forced = true;
         }else if(argv[i][0] == '/'){
@@ -615,12 +2954,24 @@ void main(int argc, const char *argv[]) CALLING
                     action = ACTION_VERIFY;
                 else if(strcmp(argv[i], "WRITE") == 0)
                     action = ACTION_WRITE;
+                else if(strcmp(argv[i], "BLANK") == 0)
+                    action = ACTION_BLANK;
+                else if(strcmp(argv[i], "ERASE") == 0)
+                    action = ACTION_ERASE;
+                else if(strcmp(argv[i], "ROLLBACK") == 0)
+                    action = ACTION_ROLLBACK;
+                else if(strcmp(argv[i], "COPY") == 0)
+                    action = ACTION_COPY;
+                else if(strcmp(argv[i], "BENCH") == 0)
+                    action = ACTION_BENCH;
                 else{
                     printf("Unrecognised command \"%s\"\n", argv[i]);
                     help();
                 }
-            }else if(filename == NULL){
-                filename = argv[i];
+            }else if(filename_count < MAX_VERIFY_IMAGES){
+                /* VERIFY alone takes several image files */
+                filenames[filename_count++] = argv[i];
+                filename = filenames[0];
             }else{
                 printf("Unexpected command line argument \"%s\"\n", argv[i]);
                 help();
@@ -628,72 +2979,73 @@ void main(int argc, const char *argv[]) CALLING
         }
     }
 
-    if(access == ACCESS_AUTO)
+    /* /Q reports only the outcome, and any problems */
+    if(quiet)
+        verbose = false;
+    else
+        banner();
+
+#ifdef ACCESS_ONLY
+    access = ACCESS_ONLY; /* fixed when this program was built */
+#else
+    access_forced = (access != ACCESS_AUTO);
+    if(!access_forced)
         access = access_auto_select();
-
-    // assume bank switching
-    flashrom_chip_read    = flashrom_chip_read_bankswitch;
-    flashrom_chip_write   = flashrom_chip_write_bankswitch;
-    flashrom_block_read   = flashrom_block_read_bankswitch;
-    flashrom_block_write  = flashrom_block_write_bankswitch;
-    flashrom_block_verify = flashrom_block_verify_bankswitch;
-
-    switch(access){
-        case ACCESS_Z180DMA:
-            puts("Using Z180 DMA engine.");
-            if(chip_count != 1){
-                puts("Z180 DMA engine supports programming a single device only.");
-                return;
-            }
-            init_z180dma();
-            flashrom_chip_read    = flashrom_chip_read_z180dma;
-            flashrom_chip_write   = flashrom_chip_write_z180dma;
-            flashrom_block_read   = flashrom_block_read_z180dma;
-            flashrom_block_write  = flashrom_block_write_z180dma;
-            flashrom_block_verify = flashrom_block_verify_z180dma;
-            break;
-        case ACCESS_UNABIOS:
-            puts("Using UNA BIOS bank switching.");
-            init_bankswitch(BANKSWITCH_UNABIOS);
-            break;
-        case ACCESS_ROMWBW_OLD:
-            puts("Using RomWBW (old) bank switching.");
-            init_bankswitch(BANKSWITCH_ROMWBW_OLD);
-            break;
-        case ACCESS_ROMWBW_26:
-            puts("Using RomWBW (v2.6+) bank switching.");
-            init_bankswitch(BANKSWITCH_ROMWBW_26);
-            break;
-        case ACCESS_P112:
-            puts("Using P112 bank switching.");
-            init_bankswitch(BANKSWITCH_P112);
-            break;
-        case ACCESS_N8VEM_SBC:
-            puts("Using N8VEM SBC bank switching.");
-            init_bankswitch(BANKSWITCH_N8VEM_SBC);
-            break;
-        case ACCESS_NONE:
-        case ACCESS_AUTO:
-            puts("Cannot determine how to access your flash ROM chip.");
-            abort_and_solicit_report();
+#endif
+
+    if(!access_setup(!quiet))
+        return;
+
+#ifndef Z180DMA_ONLY
+    if(access != ACCESS_Z180DMA){
+        bankswitch_set_irq_limit(irq_limit);
+        if(!bios_copy)
+            bankswitch_bios_copy = false;
+        if(bankswitch_bios_copy && !quiet)
+            puts("Using BIOS inter-bank copy for block reads.");
+    }
+#endif
+
+    /* a Z180 with its internal registers at 0x40 */
+    z180_io = access == ACCESS_Z180DMA || ((access == ACCESS_ROMWBW_26 || access == ACCESS_ROMWBW_OLD ||
+                access == ACCESS_UNABIOS) && detect_z180_cpu());
+    timer_init(access == ACCESS_ROMWBW_26 ? TIMER_BIOS_ROMWBW : access == ACCESS_UNABIOS ? TIMER_BIOS_UNA : TIMER_BIOS_NONE,
+            z180_io);
+    if(verbose)
+        timer_report();
+
+    /* BENCH needs only a working access method */
+    if(action == ACTION_BENCH){
+        if(filename)
+            help();
+        flashrom_bench(access_forced, save);
+        return;
     }
 
     /* identify flash ROM chip */
     if(!flashrom_identify()){
         puts("Your flash memory chip is not recognised.");
-        if(rom_mode && (action == ACTION_VERIFY || action == ACTION_READ)){
-            puts("Assuming 512KB ROM");
+        if(rom_mode && (action == ACTION_VERIFY || action == ACTION_READ || action == ACTION_BLANK)){
             flashrom_type = &rom_chip;
             flashrom_setup();
+            if(!region_forced)
+                flashrom_rom_size();
+            printf("Assuming %ldKB ROM\n", flashrom_size >> 10);
         }else{
             abort_and_solicit_report();
         }
     }
 
-    printf("Flash memory has %d chip%s %d sectors of %ld bytes, total %dKB\n",
-            chip_count, chip_count == 1 ? ",":"s, each", 
-            flashrom_type->sector_count, flashrom_sector_size,
-            (int)(flashrom_size >> 10));
+    if(!quiet)
+        printf("Flash memory has %d chip%s %d sectors of %ld bytes, total %ldKB\n",
+                chip_count, chip_count == 1 ? ",":"s, each", 
+                flashrom_type->sector_count, flashrom_sector_size,
+                flashrom_size >> 10);
+
+    if(flashrom_size > access_max_size()){
+        printf("This access method can address only the first %ldKB of flash.\n", access_max_size() >> 10);
+        return;
+    }
 
     /* P112 with ROMs larger than 32KB are limited */
     if(access == ACCESS_P112 && flashrom_size > 32768){
@@ -704,42 +3056,141 @@ void main(int argc, const char *argv[]) CALLING
         flashrom_size = 32768;
     }
 
-    if(action == ACTION_UNKNOWN || !filename)
+    /* BLANK, ERASE and COPY take no image file, the other commands require one
+       unless it comes over a serial line (when READ may name it for YMODEM) */
+    if(action == ACTION_UNKNOWN ||
+       (!serial && (action == ACTION_BLANK || action == ACTION_ERASE || action == ACTION_COPY) == (filename != NULL)) ||
+       (serial && filename && action != ACTION_READ) ||
+       (filename_count > 1 && (action != ACTION_VERIFY || serial)))
         help();
 
+    if((action == ACTION_COPY) != copy_forced){
+        puts("/FROM gives the source for COPY, and is required by it.");
+        return;
+    }
+
+    /* the undo file records where each sector belongs */
+    if(action == ACTION_ROLLBACK && region_forced){
+        puts("ROLLBACK restores the whole flash ROM: /OFFSET and /LENGTH cannot be used.");
+        return;
+    }
+
+    if(!flashrom_setup_region(region_forced)){
+        puts("/OFFSET and /LENGTH must lie within the flash ROM and be multiples of the\n" \
+             "sector size (or of 128 bytes for READ).");
+        return;
+    }
+
+    if(fast_read)
+        fast_read_setup(z180_io);
+
+    if(serial){
+        serial_transfer(filename, allow_partial, update);
+        report_stats();
+        return;
+    }
+
+    if(filename_count > 1){
+        flashrom_verify_images(filenames, filename_count, allow_partial);
+        report_stats();
+        return;
+    }
+
+    /* BLANK, ERASE and COPY work on the flash alone */
+    if(action == ACTION_BLANK){
+        flashrom_blank_check();
+        return;
+    }
+    if(action == ACTION_ERASE){
+        if(flashrom_erase())
+            puts("\n*** ERASE FAILED ***\n");
+        report_stats();
+        return;
+    }
+    if(action == ACTION_COPY){
+        flashrom_copy();
+        report_stats();
+        return;
+    }
+
     cpm_f_prepare(&imagefile, filename);
+    checkpoint_prepare(filename);
+    if(action == ACTION_ROLLBACK)
+        image_type = IMAGE_UNDO;
+    else if(hex_image_file(&imagefile))
+        image_type = IMAGE_HEX;
+
+    if(undo && action == ACTION_WRITE){
+        undo_prepare(filename);
+        if(memcmp(imagefile.ext, undo_file.ext, 3) == 0){
+            puts("/UNDO cannot be used with an image file named .UND");
+            return;
+        }
+    }else
+        undo = false;
 
     /* execute action */
     switch(action){
         case ACTION_READ:
-            cpm_f_delete(&imagefile);     /* remove existing file first */
-            if(cpm_f_create(&imagefile)){
-                printf("Cannot create file \"%s\".\n", filename);
+            if(image_type == IMAGE_HEX){
+                puts("READ writes binary image files only.");
                 return;
             }
-            flashrom_read(&imagefile);
+            if(update && cpm_f_open(&imagefile) == 0){
+                /* CP/M cannot shorten a file, so a longer one is written afresh */
+                if(cpm_f_getsize(&imagefile) > region_length / CPM_BLOCK_SIZE){
+                    cpm_f_close(&imagefile);
+                    update = false;
+                }
+            }else
+                update = false;
+            if(!update){
+                cpm_f_delete(&imagefile);     /* remove existing file first */
+                if(cpm_f_create(&imagefile)){
+                    printf("Cannot create file \"%s\".\n", filename);
+                    return;
+                }
+            }
+            flashrom_read(&imagefile, update);
             break;
         case ACTION_VERIFY:
         case ACTION_WRITE:
+        case ACTION_ROLLBACK:
             if(cpm_f_open(&imagefile)){
                 printf("Cannot open file \"%s\".\n", filename);
                 return;
             }
-            if(!check_file_size(&imagefile, allow_partial)){
+            if(image_type == IMAGE_UNDO){
+                if(!undo_load(&imagefile))
+                    return;
+            }else if(image_type == IMAGE_HEX){
+                if(!image_scan_hex(&imagefile))
+                    return;
+            }else if(!check_file_size(&imagefile, allow_partial)){
                 puts("Image file size does not match ROM size: Aborting\n" \
                      "You may use /PARTIAL to program only the start of the ROM, however for\n" \
-                     "safety reasons the image file must be a multiple of exactly 32KB long.");
+                     "safety reasons the image file must be a multiple of exactly 32KB long.\n" \
+                     "Use /OFFSET and /LENGTH to program a region elsewhere in the ROM.");
                 return;
-            }
-            if(action == ACTION_WRITE)
-                mismatch = flashrom_verify_and_write(&imagefile, true); /* we avoid verifying if nothing changed */
+            }else if(stage)
+                image_stage(&imagefile);
+            if(action != ACTION_VERIFY && plan_only){
+                flashrom_verify_and_write(&imagefile, true);
+                puts("Plan only: flash ROM not modified.");
+                mismatch = 0;
+            }else if(action != ACTION_VERIFY)
+                mismatch = flashrom_verify_and_write(&imagefile, true); /* sectors left unverified */
             else
                 mismatch = 1; /* force a verify if we're not writing */
             if(mismatch)
-                flashrom_verify_and_write(&imagefile, false);
+                mismatch = flashrom_verify_and_write(&imagefile, false);
+            checkpoint_finish(mismatch == 0); /* keep the checkpoint if the write failed */
+            break;
+        default:
             break;
     }
 
     cpm_f_close(&imagefile);
+    report_stats();
 }
 
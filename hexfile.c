@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include "libcpm.h"
+#include "buffers.h"
+#include "hexfile.h"
+
+/* line types returned by hex_line_start() */
+#define LINE_DATA   0
+#define LINE_OTHER  1 /* header, address extension, record count or start address */
+#define LINE_END    2
+#define LINE_ERROR  3
+
+#define CPM_EOF_CHAR 0x1A
+
+typedef struct {
+    unsigned long record;   /* 128-byte record of the file */
+    unsigned char offset;   /* next byte within the record */
+    unsigned long base;     /* Intel HEX extended address in force */
+    unsigned int line;      /* line number, for error messages */
+} hex_position_t;
+
+unsigned long hex_lowest, hex_highest, hex_bytes;
+
+static cpm_fcb *hex_fcb;
+static hex_position_t pos;          /* where we are reading */
+static hex_position_t resume;       /* where the next hex_fill() may start reading */
+static unsigned long resume_address;
+static unsigned long loaded_record; /* record held in hexbuffer */
+static bool loaded;
+static bool sorted;                 /* data records appear in ascending address order */
+
+static unsigned long line_address;  /* address of the first data byte on the line */
+static unsigned char line_count;    /* data bytes on the line */
+static unsigned char checksum;      /* sum of the bytes read from the line */
+static unsigned char checksum_ok;   /* sum of all the bytes on a good line */
+
+static const char hex_extensions[] = "HEXIHXS19S28S37SREMOT";
+
+bool hex_image_file(const cpm_fcb *fcb)
+{
+    const char *ext;
+    unsigned char i;
+
+    for(ext = hex_extensions; *ext; ext += 3){
+        for(i=0; i<3 && toupper(fcb->ext[i]) == ext[i]; i++);
+        if(i == 3)
+            return true;
+    }
+
+    return false;
+}
+
+static void hex_rewind(void)
+{
+    memset(&pos, 0, sizeof(pos));
+}
+
+void hex_open(cpm_fcb *fcb)
+{
+    hex_fcb = fcb;
+    loaded = false;
+    sorted = false;
+    hex_rewind();
+}
+
+static int hex_getc(void)
+{
+    unsigned char r;
+
+    if(pos.offset == CPM_BLOCK_SIZE){
+        pos.record++;
+        pos.offset = 0;
+    }
+
+    if(!loaded || loaded_record != pos.record){
+        r = cpm_f_read_random(hex_fcb, pos.record, hexbuffer);
+        if(r == 1 || r == 4)
+            return -1; /* end of file */
+        if(r){
+            printf("cpm_f_read()=%d\n", r);
+            cpm_abort();
+        }
+        loaded = true;
+        loaded_record = pos.record;
+    }
+
+    if(hexbuffer[pos.offset] == CPM_EOF_CHAR)
+        return -1;
+
+    return hexbuffer[pos.offset++];
+}
+
+static int hex_byte(void)
+{
+    unsigned char i, digit, value = 0;
+    int c;
+
+    for(i=0; i<2; i++){
+        c = hex_getc();
+        if(c >= '0' && c <= '9')
+            digit = c - '0';
+        else if(c >= 'A' && c <= 'F')
+            digit = c - 'A' + 10;
+        else if(c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else
+            return -1;
+        value = (value << 4) | digit;
+    }
+
+    checksum += value;
+    return value;
+}
+
+static bool hex_number(unsigned char bytes, unsigned long *value)
+{
+    int b;
+
+    /* big-endian, as both formats write addresses */
+    *value = 0;
+    while(bytes--){
+        b = hex_byte();
+        if(b < 0)
+            return false;
+        *value = (*value << 8) | b;
+    }
+
+    return true;
+}
+
+/* read the data bytes on the line into the buffer, which holds the flash
+   contents from address onwards, then check the line checksum */
+static bool hex_line_data(unsigned long address, unsigned char *buffer, unsigned int length)
+{
+    unsigned long offset;
+    int b;
+
+    offset = line_address - address; /* wraps round when the line starts before the buffer */
+    while(line_count--){
+        b = hex_byte();
+        if(b < 0)
+            return false;
+        if(offset < length)
+            buffer[offset] = b;
+        offset++;
+    }
+
+    return hex_byte() >= 0 && checksum == checksum_ok;
+}
+
+/* read up to the data of the next line; other lines are read completely */
+static unsigned char hex_line_start(void)
+{
+    int c, count, type;
+    unsigned long value;
+
+    do{
+        c = hex_getc();
+        if(c < 0)
+            return LINE_END; /* tolerate a missing end record */
+    }while(c == '\r' || c == '\n' || c == ' ' || c == '\t');
+
+    pos.line++;
+    checksum = 0;
+
+    if(c == ':'){
+        /* Intel HEX: count, 16-bit address, type, data, checksum */
+        checksum_ok = 0;
+        count = hex_byte();
+        if(count < 0 || !hex_number(2, &value) || (type = hex_byte()) < 0)
+            return LINE_ERROR;
+        line_count = count;
+        switch(type){
+            case 0:
+                line_address = pos.base + value;
+                return LINE_DATA;
+            case 1:
+                type = LINE_END;
+                break;
+            case 2: /* extended segment address */
+            case 4: /* extended linear address */
+                if(count != 2 || !hex_number(2, &value))
+                    return LINE_ERROR;
+                pos.base = value << (type == 2 ? 4 : 16);
+                line_count = 0;
+                type = LINE_OTHER;
+                break;
+            case 3: /* start addresses are of no interest to us */
+            case 5:
+                type = LINE_OTHER;
+                break;
+            default:
+                return LINE_ERROR;
+        }
+    }else if(c == 'S'){
+        /* S-record: type, count, 16/24/32-bit address, data, checksum */
+        checksum_ok = 0xFF;
+        type = hex_getc();
+        count = hex_byte();
+        if(type < '0' || type > '9' || type == '4' || count < 1)
+            return LINE_ERROR;
+        if(type >= '1' && type <= '3'){
+            type = type - '0' + 1; /* address bytes */
+            if(count < type + 1 || !hex_number(type, &line_address))
+                return LINE_ERROR;
+            line_count = count - type - 1;
+            return LINE_DATA;
+        }
+        line_count = count - 1;
+        type = (type >= '7') ? LINE_END : LINE_OTHER;
+    }else
+        return LINE_ERROR;
+
+    /* skip the rest of the line, checking the checksum */
+    if(!hex_line_data(0, NULL, 0))
+        return LINE_ERROR;
+
+    return type;
+}
+
+static void hex_error(void)
+{
+    printf("\nHex file error on line %d\n", pos.line);
+}
+
+bool hex_scan(void (*cover)(unsigned long address, unsigned int length))
+{
+    unsigned char type;
+    unsigned long previous = 0;
+
+    hex_rewind();
+    sorted = true;
+    hex_lowest = 0xFFFFFFFFUL;
+    hex_highest = 0;
+    hex_bytes = 0;
+
+    while((type = hex_line_start()) != LINE_END){
+        if(type == LINE_DATA && line_count){
+            if(line_address < previous)
+                sorted = false;
+            previous = line_address;
+            if(line_address < hex_lowest)
+                hex_lowest = line_address;
+            if(line_address + line_count - 1 > hex_highest)
+                hex_highest = line_address + line_count - 1;
+            hex_bytes += line_count;
+            cover(line_address, line_count);
+        }
+        if(type == LINE_ERROR || (type == LINE_DATA && !hex_line_data(0, NULL, 0))){
+            hex_error();
+            return false;
+        }
+    }
+
+    memset(&resume, 0, sizeof(resume));
+    resume_address = 0;
+
+    return true;
+}
+
+bool hex_fill(unsigned long address, unsigned char *buffer, unsigned int length)
+{
+    hex_position_t line;
+    unsigned char type;
+    bool resume_found = false;
+
+    memset(buffer, 0xFF, length);
+
+    /* The image is read in ascending address order, so with a sorted file we
+       can start from the first line the previous fill needed and stop at the
+       first line beyond the buffer: each pass reads the file only once. An
+       unsorted file has to be read in full every time. */
+    if(sorted && address >= resume_address)
+        memcpy(&pos, &resume, sizeof(pos));
+    else
+        hex_rewind();
+
+    while(true){
+        memcpy(&line, &pos, sizeof(pos));
+        type = hex_line_start();
+        if(type == LINE_END)
+            break;
+        if(type == LINE_DATA){
+            if(sorted){
+                if(!resume_found && line_address + line_count > address){
+                    memcpy(&resume, &line, sizeof(line));
+                    resume_found = true;
+                }
+                if(line_address >= address + length)
+                    break;
+            }
+            if(hex_line_data(address, buffer, length))
+                continue;
+        }else if(type == LINE_OTHER)
+            continue;
+        hex_error();
+        return false;
+    }
+
+    if(sorted){
+        if(!resume_found)
+            memcpy(&resume, &line, sizeof(line));
+        resume_address = address;
+    }
+
+    return true;
+}
@@ -0,0 +1,24 @@
+#ifndef __HEXFILE_DOT_H__
+#define __HEXFILE_DOT_H__
+
+#include <stdbool.h>
+#include "libcpm.h"
+
+/* Intel HEX and Motorola S-record image files are parsed a line at a time
+   straight from disk, so a file covering a few KB of the flash costs a few KB
+   of disk reads rather than a whole padded ROM image. Addresses in the file
+   are flash ROM addresses. */
+
+bool hex_image_file(const cpm_fcb *fcb);  /* file extension says this is a hex file */
+void hex_open(cpm_fcb *fcb);
+/* check the whole file, calling cover() for each data record; false on error */
+bool hex_scan(void (*cover)(unsigned long address, unsigned int length));
+/* fill buffer with the file contents for a range of addresses, 0xFF where the file has no data */
+bool hex_fill(unsigned long address, unsigned char *buffer, unsigned int length);
+
+/* results of hex_scan() */
+extern unsigned long hex_lowest;   /* lowest address holding data */
+extern unsigned long hex_highest;  /* highest address holding data */
+extern unsigned long hex_bytes;    /* data bytes in the file */
+
+#endif
@@ -0,0 +1,416 @@
+/*
+    Host build of FLASH4: stand-in for libcpm.s backed by host files.
+
+    flash4.c and libcpm2.c are compiled natively together with this file
+    and hostflash.c (the simulated flash chips) so that the programming
+    algorithms can be exercised and measured on a Linux machine. Build with
+    "make flash4-host"; "./bench" runs the benchmark scenarios.
+
+    The BDOS functions return the same codes a real CP/M 3 BDOS would.
+    Files are named as in the FCB, without the drive letter, in the
+    current directory.
+
+    The BIOS clock and CPU speed calls of timer.s are answered from the host
+    clock. Environment variables:
+      SIM_CPU_KHZ    CPU clock reported by the BIOS (default 8000, 0 = not reported)
+      SIM_TICK_RATE  HBIOS ticks per second (default 50, 0 = no HBIOS timer)
+
+    The serial character I/O of xmodem.s, for the console and every HBIOS
+    unit alike, goes to the file named by SIM_SERIAL: usually one side of a
+    pty whose other side runs an XMODEM or YMODEM program, standing in for
+    the other computer.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include "libcpm.h"
+#include "buffers.h"
+#include "bankswitch.h"
+#include "timer.h"
+#include "xmodem.h"
+#include "hostsim.h"
+
+/* buffers.s places these in _BSS on CP/M */
+unsigned char filebuffer[CPM_BLOCK_SIZE * FILEBUFFER_BLOCKS];
+unsigned char rombuffer[CPM_BLOCK_SIZE];
+unsigned char sector_map[SECTOR_MAP_BYTES];
+unsigned char checkpointbuffer[CPM_BLOCK_SIZE];
+unsigned char image_map[SECTOR_MAP_BYTES];
+unsigned char hexbuffer[CPM_BLOCK_SIZE];
+unsigned char packetbuffer[PACKETBUFFER_SIZE];
+
+#define BDOS_READ_UNWRITTEN_DATA   1 /* read random: record beyond the end of the file */
+#define BDOS_READ_UNWRITTEN_EXTENT 4 /* read random: extent beyond the end of the file */
+#define BDOS_RECORD_OUT_OF_RANGE   6 /* random record beyond the largest file CP/M 3 supports */
+#define CPM_EOF_CHAR            0x1A
+
+/* the host FILE pointer is kept in the FCB allocation map, which the BDOS owns */
+static FILE *fcb_file(cpm_fcb *fcb)
+{
+    FILE *f;
+    memcpy(&f, fcb->al, sizeof(f));
+    return f;
+}
+
+static void fcb_set_file(cpm_fcb *fcb, FILE *f)
+{
+    memcpy(fcb->al, &f, sizeof(f));
+}
+
+static const char *fcb_filename(cpm_fcb *fcb)
+{
+    static char name[13];
+    int i, len = 0;
+
+    for(i=0; i<8 && fcb->name[i] != ' '; i++)
+        name[len++] = fcb->name[i];
+    if(fcb->ext[0] != ' '){
+        name[len++] = '.';
+        for(i=0; i<3 && fcb->ext[i] != ' '; i++)
+            name[len++] = fcb->ext[i];
+    }
+    name[len] = 0;
+
+    return name;
+}
+
+static unsigned long fcb_record(cpm_fcb *fcb)
+{
+    return fcb->r0 | ((unsigned long)fcb->r1 << 8) | ((unsigned long)fcb->r2 << 16);
+}
+
+void console_flush(void)
+{
+    /* stdout does our buffering */
+    fflush(stdout);
+}
+
+void cpm_abort(void) CALLING
+{
+    /* BDOS function 0 does not return; the simulation is saved by atexit() */
+    exit(1);
+}
+
+int cpm_f_delete(cpm_fcb *fcb) CALLING
+{
+    return remove(fcb_filename(fcb)) ? -1 : 0;
+}
+
+int cpm_f_open(cpm_fcb *fcb) CALLING
+{
+    FILE *f = fopen(fcb_filename(fcb), "r+b");
+    if(!f)
+        return -1;
+    fcb_set_file(fcb, f);
+    return 0;
+}
+
+int cpm_f_create(cpm_fcb *fcb) CALLING
+{
+    FILE *f = fopen(fcb_filename(fcb), "w+b");
+    if(!f)
+        return -1;
+    fcb_set_file(fcb, f);
+    return 0;
+}
+
+int cpm_f_close(cpm_fcb *fcb) CALLING
+{
+    FILE *f = fcb_file(fcb);
+    if(!f)
+        return -1;
+    fclose(f);
+    fcb_set_file(fcb, NULL);
+    return 0;
+}
+
+unsigned long cpm_f_getsize(cpm_fcb *fcb) CALLING
+{
+    FILE *f = fcb_file(fcb);
+    unsigned long records;
+
+    fseek(f, 0, SEEK_END);
+    records = (ftell(f) + CPM_BLOCK_SIZE - 1) / CPM_BLOCK_SIZE;
+
+    fcb->r0 = records;
+    fcb->r1 = records >> 8;
+    fcb->r2 = records >> 16;
+
+    return records;
+}
+
+static unsigned char host_read(cpm_fcb *fcb, unsigned long record, char *buffer)
+{
+    FILE *f = fcb_file(fcb);
+    unsigned long size;
+    size_t r;
+
+    fseek(f, 0, SEEK_END);
+    size = (ftell(f) + CPM_BLOCK_SIZE - 1) / CPM_BLOCK_SIZE;
+    if(record >= size)
+        /* an extent is 128 records; reading past the last one is a different error */
+        return ((record >> 7) > ((size - 1) >> 7) || !size) ? BDOS_READ_UNWRITTEN_EXTENT : BDOS_READ_UNWRITTEN_DATA;
+
+    fseek(f, record * CPM_BLOCK_SIZE, SEEK_SET);
+    r = fread(buffer, 1, CPM_BLOCK_SIZE, f);
+    if(r < CPM_BLOCK_SIZE) /* host files need not be a whole number of records */
+        memset(buffer + r, CPM_EOF_CHAR, CPM_BLOCK_SIZE - r);
+    sim_stats.records_read++;
+
+    return 0;
+}
+
+static unsigned char host_write(cpm_fcb *fcb, unsigned long record, char *buffer)
+{
+    FILE *f = fcb_file(fcb);
+
+    fseek(f, record * CPM_BLOCK_SIZE, SEEK_SET);
+    if(fwrite(buffer, 1, CPM_BLOCK_SIZE, f) != CPM_BLOCK_SIZE)
+        return 2; /* disk full */
+    sim_stats.records_written++;
+
+    return 0;
+}
+
+unsigned char cpm_f_read_next(cpm_fcb *fcb, char *buffer) CALLING
+{
+    unsigned long record = fcb->cr + ((unsigned long)fcb->ex << 7);
+    unsigned char r;
+
+    r = host_read(fcb, record, buffer);
+    if(r)
+        return 1; /* end of file */
+    record++;
+    fcb->cr = record & 0x7F;
+    fcb->ex = record >> 7;
+
+    return 0;
+}
+
+unsigned char cpm_f_write_next(cpm_fcb *fcb, char *buffer) CALLING
+{
+    unsigned long record = fcb->cr + ((unsigned long)fcb->ex << 7);
+    unsigned char r;
+
+    r = host_write(fcb, record, buffer);
+    if(r)
+        return r;
+    record++;
+    fcb->cr = record & 0x7F;
+    fcb->ex = record >> 7;
+
+    return 0;
+}
+
+unsigned char cpm_f_read_random(cpm_fcb *fcb, unsigned long block, void *buffer) CALLING
+{
+    fcb->r0 = block;
+    fcb->r1 = block >> 8;
+    fcb->r2 = block >> 16;
+
+    if(fcb->r2 > 3)
+        return BDOS_RECORD_OUT_OF_RANGE;
+
+    return host_read(fcb, fcb_record(fcb), buffer);
+}
+
+unsigned char cpm_f_write_random(cpm_fcb *fcb, unsigned long block, void *buffer) CALLING
+{
+    fcb->r0 = block;
+    fcb->r1 = block >> 8;
+    fcb->r2 = block >> 16;
+
+    if(fcb->r2 > 3)
+        return BDOS_RECORD_OUT_OF_RANGE;
+
+    return host_write(fcb, fcb_record(fcb), buffer);
+}
+
+unsigned int cpm_get_version(void) CALLING
+{
+    return 0x31;
+}
+
+static unsigned char bcd(int value)
+{
+    return ((value / 10) << 4) | (value % 10);
+}
+
+unsigned char cpm_t_get(cpm_dat *dat) CALLING
+{
+    time_t now = time(NULL);
+    struct tm *tm = localtime(&now);
+
+    dat->day = now / 86400 - 2921; /* 1 January 1978 is day 1 */
+    dat->hour = bcd(tm->tm_hour);
+    dat->minute = bcd(tm->tm_min);
+
+    return bcd(tm->tm_sec);
+}
+
+static unsigned long env_number(const char *name, unsigned long def)
+{
+    const char *value = getenv(name);
+    return value ? strtoul(value, NULL, 0) : def;
+}
+
+static unsigned long host_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+unsigned int timer_hbios_cpu_khz(void) CALLING
+{
+    return env_number("SIM_CPU_KHZ", BANKSWITCH_CPU_MHZ * 1000);
+}
+
+unsigned long timer_hbios_ticks(void) CALLING
+{
+    return host_ms() * timer_hbios_tick_rate() / 1000;
+}
+
+unsigned char timer_hbios_tick_rate(void) CALLING
+{
+    return env_number("SIM_TICK_RATE", 50);
+}
+
+unsigned long timer_una_cpu_hz(void) CALLING
+{
+    return timer_hbios_cpu_khz() * 1000UL;
+}
+
+unsigned int timer_z180_prt0_reload(void) CALLING
+{
+    return 0;
+}
+
+void timer_spin(unsigned int loops) CALLING
+{
+    unsigned long khz = timer_hbios_cpu_khz();
+    struct timespec ts;
+
+    /* as long as the Z80 loop would take */
+    if(!khz)
+        khz = TIMER_DEFAULT_KHZ;
+    ts.tv_sec = 0;
+    ts.tv_nsec = (unsigned long)loops * TIMER_SPIN_TSTATES_Z80 * 1000000UL / khz;
+    nanosleep(&ts, NULL);
+}
+
+static int serial_fd = -1;
+
+static int serial_open(void)
+{
+    const char *path = getenv("SIM_SERIAL");
+    struct termios tio;
+
+    if(serial_fd >= 0)
+        return serial_fd;
+    if(!path || (serial_fd = open(path, O_RDWR | O_NOCTTY)) < 0){
+        fprintf(stderr, "SIM: set SIM_SERIAL to the serial line (eg a pty) for transfers\n");
+        exit(1);
+    }
+    if(tcgetattr(serial_fd, &tio) == 0){
+        cfmakeraw(&tio);
+        tcsetattr(serial_fd, TCSANOW, &tio);
+    }
+
+    return serial_fd;
+}
+
+unsigned char serial_bios_status(void) CALLING
+{
+    struct pollfd pfd;
+
+    pfd.fd = serial_open();
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN))
+        return 0xFF; /* as BIOS CONST */
+
+    /* a poll costs the Z80 at least this long, which timeouts without a clock rely on */
+    timer_spin(TIMER_POLL_TSTATES / TIMER_SPIN_TSTATES_Z80);
+    return 0;
+}
+
+unsigned char serial_bios_in(void) CALLING
+{
+    unsigned char c = 0;
+
+    if(read(serial_open(), &c, 1) != 1){
+        fprintf(stderr, "SIM: serial line closed\n");
+        exit(1);
+    }
+    return c;
+}
+
+void serial_bios_out(unsigned char c) CALLING
+{
+    if(write(serial_open(), &c, 1) != 1){
+        fprintf(stderr, "SIM: serial line closed\n");
+        exit(1);
+    }
+}
+
+unsigned char serial_hbios_status(unsigned char unit) CALLING
+{
+    return serial_bios_status();
+}
+
+unsigned char serial_hbios_in(unsigned char unit) CALLING
+{
+    return serial_bios_in();
+}
+
+void serial_hbios_out(unsigned char unit, unsigned char c) CALLING
+{
+    serial_bios_out(c);
+}
+
+static void host_exit(void)
+{
+    fflush(stdout);
+    sim_save();
+    sim_report();
+}
+
+#undef main
+extern void flash4_main(int argc, const char *argv[]);
+
+int main(int argc, const char *argv[])
+{
+    const char **args;
+    int i;
+    bool access_forced = false;
+
+    /* The simulated machine presents RomWBW style bank switching unless
+       another method is forced; the auto-detection would otherwise probe
+       CP/M memory which does not exist here. */
+    for(i=1; i<argc; i++)
+        if(!strcmp(argv[i], "/ROMWBW") || !strcmp(argv[i], "/ROMWBWOLD") || !strcmp(argv[i], "/UNABIOS") ||
+           !strcmp(argv[i], "/P112") || !strcmp(argv[i], "/N8VEMSBC") || !strcmp(argv[i], "/Z180DMA"))
+            access_forced = true;
+
+    args = malloc((argc + 2) * sizeof(char*));
+    if(!args)
+        return 1;
+    memcpy(args, argv, argc * sizeof(char*));
+    if(!access_forced)
+        args[argc++] = "/ROMWBW";
+    args[argc] = NULL;
+
+    sim_load();
+    atexit(host_exit);
+    flash4_main(argc, args);
+
+    return 0;
+}
@@ -0,0 +1,514 @@
+/*
+    Simulated flash ROM for the host build of FLASH4 (see hostcpm.c).
+
+    This stands in for bankswitch.s, bankswitch2.c, z180dma2.c and
+    detectcpu.s. One or more JEDEC style flash chips are simulated with
+    uniform sectors (AT29C style sector programming is not simulated); the
+    contents are loaded from and saved to a host file.
+    Every flash bus cycle and bank switch is counted so that the cost of
+    an operation can be measured without real hardware. The time spent in
+    the inner loops of bankswitch.s is modelled from the T-states per byte
+    given in bankswitch.h.
+
+    Environment variables:
+      SIM_FLASH      file holding the flash contents (default FLASH.SIM)
+      SIM_CHIP_ID    chip ID in hex (default BFB7, SST 39SF040)
+      SIM_CHIP_SIZE  size of each chip in bytes (default 524288)
+      SIM_SECTOR     sector size in bytes (default 4096)
+      SIM_CHIPS      number of chips fitted (default 1)
+      SIM_RAM_BANKS  32KB RAM banks fitted, RomWBW style (default 16)
+      SIM_BIOS_COPY  1 if the BIOS offers inter-bank copies (default 0)
+      SIM_Z180       1 for a Z180 CPU, whose DCNTL register is simulated (default 0)
+      SIM_READ_WAITS memory wait states the flash needs to be read reliably (default 0)
+      SIM_POWER_FAIL the power fails as this erase operation (counting from 1)
+                     completes, to test resuming an interrupted WRITE (default 0, never)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "libcpm.h"
+#include "bankswitch.h"
+#include "z180dma.h"
+#include "detectcpu.h"
+#include "hostsim.h"
+
+unsigned int default_mem_bank;
+unsigned char bank_switch_method = 0xff;
+unsigned int rom_bank_count = 0;
+bool irq_enabled_flag = true;
+unsigned int bankswitch_read_chunk = 0;
+unsigned int bankswitch_write_chunk = 0;
+bool bankswitch_bios_copy = false;
+unsigned long bankswitch_bios_bytes = 0;
+unsigned char bankswitch_rom_waits = BANKSWITCH_P112_ROM_WAITS;
+unsigned long bankswitch_ldir_bytes = 0;
+
+sim_stats_t sim_stats;
+
+static unsigned char *flash;
+static const char *flash_filename;
+static unsigned long chip_size, sector_size, flash_size;
+static unsigned int chip_id;
+
+/* banked RAM, from BANKSWITCH_RAM_BASE; as in RomWBW the top four banks
+   belong to the BIOS and CP/M and the rest hold the RAM disk */
+static unsigned char *ram;
+static unsigned long ram_size;
+
+/* JEDEC command state machine, one per chip */
+#define CMD_READ        0
+#define CMD_UNLOCK1     1 /* AA written to 5555 */
+#define CMD_UNLOCK2     2 /* 55 written to 2AAA */
+#define CMD_PROGRAM     3 /* A0 written, next write programs a byte */
+#define CMD_ERASE       4 /* 80 written */
+#define CMD_ERASE1      5 /* AA written to 5555 after 80 */
+#define CMD_ERASE2      6 /* 55 written to 2AAA after 80 */
+
+#define MAX_SIM_CHIPS 16
+
+static unsigned char cmd_state[MAX_SIM_CHIPS];
+static bool id_mode[MAX_SIM_CHIPS];
+
+/* Z180 DCNTL: 3 memory and 3 I/O wait states, as after reset */
+static unsigned char sim_dcntl = 0xF0;
+static unsigned int read_waits;   /* wait states the flash needs */
+static unsigned long power_fail;  /* erase operation after which we stop dead */
+
+static unsigned long env_number(const char *name, unsigned long def, int base)
+{
+    const char *value = getenv(name);
+    return value ? strtoul(value, NULL, base) : def;
+}
+
+void sim_load(void)
+{
+    FILE *f;
+    unsigned int chips;
+
+    flash_filename = getenv("SIM_FLASH");
+    if(!flash_filename)
+        flash_filename = "FLASH.SIM";
+    chip_id = env_number("SIM_CHIP_ID", 0xBFB7, 16);
+    chip_size = env_number("SIM_CHIP_SIZE", 512*1024, 0);
+    sector_size = env_number("SIM_SECTOR", 4096, 0);
+    chips = env_number("SIM_CHIPS", 1, 0);
+    read_waits = env_number("SIM_READ_WAITS", 0, 0);
+    power_fail = env_number("SIM_POWER_FAIL", 0, 0);
+    if(chips < 1 || chips > MAX_SIM_CHIPS || !sector_size || chip_size % sector_size){
+        fprintf(stderr, "bad simulated flash geometry\n");
+        exit(1);
+    }
+    flash_size = chip_size * chips;
+    ram_size = env_number("SIM_RAM_BANKS", 16, 0) << 15;
+    ram = calloc(1, ram_size ? ram_size : 1);
+
+    flash = malloc(flash_size);
+    if(!flash){
+        fprintf(stderr, "malloc() failed\n");
+        exit(1);
+    }
+    memset(flash, 0xFF, flash_size);
+
+    f = fopen(flash_filename, "rb");
+    if(f){
+        if(fread(flash, 1, flash_size, f) == 0)
+            fprintf(stderr, "%s: empty, starting with erased flash\n", flash_filename);
+        fclose(f);
+    }
+}
+
+void sim_save(void)
+{
+    FILE *f;
+
+    f = fopen(flash_filename, "wb");
+    if(!f || fwrite(flash, 1, flash_size, f) != flash_size)
+        fprintf(stderr, "%s: cannot save flash contents\n", flash_filename);
+    if(f)
+        fclose(f);
+}
+
+void sim_report(void)
+{
+    fprintf(stderr, "SIM bus_reads=%lu bus_writes=%lu bank_switches=%lu "
+                    "records_read=%lu records_written=%lu "
+                    "sector_erases=%lu chip_erases=%lu bytes_programmed=%lu irq_windows=%lu bios_copies=%lu "
+                    "kernel_ms=%lu\n",
+            sim_stats.bus_reads, sim_stats.bus_writes, sim_stats.bank_switches,
+            sim_stats.records_read, sim_stats.records_written,
+            sim_stats.sector_erases, sim_stats.chip_erases, sim_stats.bytes_programmed,
+            sim_stats.irq_windows, sim_stats.bios_copies,
+            sim_stats.kernel_tstates / (BANKSWITCH_CPU_MHZ * 1000UL));
+}
+
+static bool sim_is_ram(unsigned long address)
+{
+    return address >= BANKSWITCH_RAM_BASE;
+}
+
+static unsigned char *sim_ram(unsigned long address)
+{
+    address -= BANKSWITCH_RAM_BASE;
+    if(address >= ram_size){
+        fprintf(stderr, "RAM bank 0x%02lX is not fitted\n", BANKSWITCH_RAM_BANK0 + (address >> 15));
+        exit(1);
+    }
+    return &ram[address];
+}
+
+static unsigned long sim_wrap(unsigned long address)
+{
+    /* address lines beyond the fitted chips are not decoded */
+    return address % flash_size;
+}
+
+/* memory wait states in force for a flash access */
+static unsigned int sim_waits(void)
+{
+    if(bank_switch_method == BANKSWITCH_P112)
+        return bankswitch_rom_waits >> 6;
+    return sim_dcntl >> 6;
+}
+
+static unsigned char sim_read(unsigned long address)
+{
+    if(sim_is_ram(address))
+        return *sim_ram(address);
+    address = sim_wrap(address);
+    sim_stats.bus_reads++;
+    if(id_mode[address / chip_size] && (address % chip_size) < 2)
+        return (address & 1) ? (chip_id & 0xFF) : (chip_id >> 8);
+    if(sim_waits() < read_waits)
+        return flash[address] ^ 0x01; /* read too soon */
+    return flash[address];
+}
+
+static void sim_write(unsigned long address, unsigned char value)
+{
+    unsigned int chip;
+    unsigned int offset;
+    unsigned long base;
+    unsigned char *state;
+
+    address = sim_wrap(address);
+    sim_stats.bus_writes++;
+    if(sim_waits() < 3){
+        fprintf(stderr, "SIM: flash written with %d memory wait states\n", sim_waits());
+        exit(1);
+    }
+
+    chip = address / chip_size;
+    base = address - (address % chip_size);
+    offset = address & 0x7FFF; /* command addresses are decoded on A0-A14 */
+    state = &cmd_state[chip];
+
+    switch(*state){
+        case CMD_UNLOCK1:
+            *state = (offset == 0x2AAA && value == 0x55) ? CMD_UNLOCK2 : CMD_READ;
+            return;
+        case CMD_UNLOCK2:
+            *state = CMD_READ;
+            if(offset != 0x5555)
+                return;
+            if(value == 0x90)
+                id_mode[chip] = true;
+            else if(value == 0xF0)
+                id_mode[chip] = false;
+            else if(value == 0xA0)
+                *state = CMD_PROGRAM;
+            else if(value == 0x80)
+                *state = CMD_ERASE;
+            return;
+        case CMD_PROGRAM:
+            /* programming can only clear bits */
+            flash[address] &= value;
+            sim_stats.bytes_programmed++;
+            *state = CMD_READ;
+            return;
+        case CMD_ERASE:
+            *state = (offset == 0x5555 && value == 0xAA) ? CMD_ERASE1 : CMD_READ;
+            return;
+        case CMD_ERASE1:
+            *state = (offset == 0x2AAA && value == 0x55) ? CMD_ERASE2 : CMD_READ;
+            return;
+        case CMD_ERASE2:
+            *state = CMD_READ;
+            if(value == 0x10 && offset == 0x5555){
+                memset(&flash[base], 0xFF, chip_size);
+                sim_stats.chip_erases++;
+            }else if(value == 0x30){
+                memset(&flash[address - (address % sector_size)], 0xFF, sector_size);
+                sim_stats.sector_erases++;
+            }
+            if(power_fail && sim_stats.chip_erases + sim_stats.sector_erases == power_fail){
+                /* files written so far are kept and the flash is saved by atexit(), as at a power cut */
+                fprintf(stderr, "SIM: power failed after erase %lu\n", power_fail);
+                exit(1);
+            }
+            return;
+        default:
+            if(offset == 0x5555 && value == 0xAA)
+                *state = CMD_UNLOCK1;
+            else if(value == 0xF0)
+                id_mode[chip] = false;
+            return;
+    }
+}
+
+/* bank switching: each call selects the flash bank and then restores RAM */
+
+void init_bankswitch(unsigned char method)
+{
+    bank_switch_method = method;
+    default_mem_bank = bankswitch_get_current_bank();
+    rom_bank_count = bankswitch_get_rom_bank_count();
+    bankswitch_bios_copy = (bankswitch_get_bios_version() >= BANKSWITCH_BIOS_COPY_VERSION);
+}
+
+void bankswitch_check_irq_flag(void)
+{
+    irq_enabled_flag = true;
+}
+
+/* chunks are a power of two in size so that they line up with the
+   records and subsectors the block operations are given */
+static unsigned int irq_chunk_bytes(unsigned int us, unsigned int us_per_byte)
+{
+    unsigned int bytes, chunk;
+
+    if(us == 0)
+        return 0; /* no limit */
+    bytes = us / us_per_byte;
+    for(chunk = 1; chunk <= bytes / 2; chunk <<= 1);
+
+    return chunk; /* always make some progress, even if the limit is very short */
+}
+
+void bankswitch_set_irq_limit(unsigned int us)
+{
+    bankswitch_read_chunk = irq_chunk_bytes(us, BANKSWITCH_READ_US_PER_BYTE);
+    bankswitch_write_chunk = irq_chunk_bytes(us, BANKSWITCH_WRITE_US_PER_BYTE);
+}
+
+unsigned int bankswitch_get_current_bank(void) CALLING
+{
+    return 0x80;
+}
+
+unsigned int bankswitch_get_rom_bank_count(void) CALLING
+{
+    if(bank_switch_method != BANKSWITCH_ROMWBW_26)
+        return 0; /* only RomWBW 2.6+ can tell us */
+    return flash_size >> 15;
+}
+
+unsigned int bankswitch_get_bios_version(void) CALLING
+{
+    return env_number("SIM_BIOS_COPY", 0, 0) ? BANKSWITCH_BIOS_COPY_VERSION : 0x2600;
+}
+
+unsigned int bankswitch_get_bios_bank(void) CALLING
+{
+    return (ram_size >> 15) >= 4 ? BANKSWITCH_RAM_BANK0 + (ram_size >> 15) - 3 : 0;
+}
+
+static void sim_select(void)
+{
+    sim_stats.bank_switches += 2; /* select flash, then put back RAM */
+}
+
+/* like bankswitch.s, put back RAM between chunks of a long block operation */
+static void sim_chunks(unsigned int length, unsigned int chunk)
+{
+    unsigned int windows;
+
+    if(!irq_enabled_flag || !chunk || length <= chunk)
+        return;
+    windows = (length - 1) / chunk;
+    sim_stats.irq_windows += windows;
+    sim_stats.bank_switches += 2 * windows;
+}
+
+void flashrom_chip_write_bankswitch(unsigned long address, unsigned char value) CALLING
+{
+    sim_select();
+    sim_write(address, value);
+}
+
+unsigned char flashrom_chip_read_bankswitch(unsigned long address) CALLING
+{
+    sim_select();
+    return sim_read(address);
+}
+
+/* the BIOS inter-bank copy does its own bank switching */
+static bool sim_bios_copy(unsigned int length)
+{
+    if(!bankswitch_bios_copy)
+        return false;
+    sim_stats.bios_copies++;
+    bankswitch_bios_bytes += length;
+    return true;
+}
+
+void flashrom_block_read_bankswitch(unsigned long address, unsigned char *buffer, unsigned int length) CALLING
+{
+    if(sim_bios_copy(length)){
+        while(length--)
+            *(buffer++) = sim_read(address++);
+        return;
+    }
+    bankswitch_ldir_bytes += length;
+    sim_select();
+    sim_chunks(length, bankswitch_read_chunk);
+    sim_stats.kernel_tstates += (unsigned long)length * BANKSWITCH_TSTATES_COPY;
+    while(length--)
+        *(buffer++) = sim_read(address++);
+}
+
+bool flashrom_block_verify_bankswitch(unsigned long address, unsigned char *buffer, unsigned int length) CALLING
+{
+    sim_select();
+    sim_chunks(length, bankswitch_read_chunk);
+    while(length--){
+        sim_stats.kernel_tstates += BANKSWITCH_TSTATES_VERIFY;
+        if(sim_read(address++) != *(buffer++))
+            return false;
+    }
+    return true;
+}
+
+bool flashrom_block_verify_constant_bankswitch(unsigned long address, unsigned char value, unsigned int length) CALLING
+{
+    sim_select();
+    sim_chunks(length, bankswitch_read_chunk);
+    while(length--){
+        sim_stats.kernel_tstates += BANKSWITCH_TSTATES_CONSTANT;
+        if(sim_read(address++) != value)
+            return false;
+    }
+    return true;
+}
+
+void ram_block_write_bankswitch(unsigned long address, unsigned char *buffer, unsigned int length) CALLING
+{
+    if(sim_bios_copy(length)){
+        while(length--)
+            *sim_ram(address++) = *(buffer++);
+        return;
+    }
+    bankswitch_ldir_bytes += length;
+    sim_select();
+    sim_chunks(length, bankswitch_read_chunk);
+    sim_stats.kernel_tstates += (unsigned long)length * BANKSWITCH_TSTATES_COPY;
+    while(length--)
+        *sim_ram(address++) = *(buffer++);
+}
+
+static void sim_program_byte(unsigned long address, unsigned char value)
+{
+    unsigned long base = address & ~0x7FFFUL;
+
+    sim_write(base | 0x5555, 0xAA);
+    sim_write(base | 0x2AAA, 0x55);
+    sim_write(base | 0x5555, 0xA0);
+    sim_write(address, value);
+    /* the toggle bit is polled with four reads */
+    sim_read(address);
+    sim_read(address);
+    sim_read(address);
+    sim_read(address);
+}
+
+void flashrom_block_write_bankswitch(unsigned long address, unsigned char *buffer, unsigned int length) CALLING
+{
+    sim_select();
+    sim_chunks(length, bankswitch_write_chunk);
+    while(length--){
+        /* like the assembler version, bytes of 0xFF are skipped */
+        if(*buffer != 0xFF)
+            sim_program_byte(address, *buffer);
+        else
+            sim_stats.kernel_tstates += BANKSWITCH_TSTATES_SKIP;
+        address++;
+        buffer++;
+    }
+}
+
+/* Z180 DMA: no bank switching, the flash is addressed directly */
+
+void init_z180dma(void)
+{
+}
+
+bool detect_z180_cpu(void) CALLING
+{
+    return env_number("SIM_Z180", 0, 0) != 0;
+}
+
+
+unsigned char z180_in0(unsigned char port) CALLING
+{
+    return port == 0x72 ? sim_dcntl : 0xFF;
+}
+
+void z180_out0(unsigned char port, unsigned char value) CALLING
+{
+    if(port == 0x72)
+        sim_dcntl = value;
+}
+
+
+void flashrom_chip_write_z180dma(unsigned long address, unsigned char value) CALLING
+{
+    sim_write(address, value);
+}
+
+unsigned char flashrom_chip_read_z180dma(unsigned long address) CALLING
+{
+    return sim_read(address);
+}
+
+void flashrom_block_read_z180dma(unsigned long address, unsigned char *buffer, unsigned int length) CALLING
+{
+    while(length--)
+        *(buffer++) = sim_read(address++);
+}
+
+/* the DMA engine copies a record at a time into RAM before it is compared */
+static bool sim_dma_compare(unsigned long address, unsigned char *buffer, unsigned char value, unsigned int length)
+{
+    unsigned int bytes;
+    bool okay = true;
+
+    while(length > 0 && okay){
+        bytes = (length >= CPM_BLOCK_SIZE) ? CPM_BLOCK_SIZE : length;
+        length -= bytes;
+        while(bytes--){
+            if(sim_read(address++) != (buffer ? *buffer : value))
+                okay = false;
+            if(buffer)
+                buffer++;
+        }
+    }
+
+    return okay;
+}
+
+bool flashrom_block_verify_z180dma(unsigned long address, unsigned char *buffer, unsigned int length) CALLING
+{
+    return sim_dma_compare(address, buffer, 0, length);
+}
+
+bool flashrom_block_verify_constant_z180dma(unsigned long address, unsigned char value, unsigned int length) CALLING
+{
+    return sim_dma_compare(address, NULL, value, length);
+}
+
+void flashrom_block_write_z180dma(unsigned long address, unsigned char *buffer, unsigned int length) CALLING
+{
+    while(length--)
+        sim_program_byte(address++, *(buffer++));
+}
@@ -0,0 +1,25 @@
+#ifndef __HOSTSIM_DOT_H__
+#define __HOSTSIM_DOT_H__
+
+/* counters kept by the host build (hostcpm.c, hostflash.c) */
+typedef struct {
+    unsigned long bus_reads;        /* flash read cycles */
+    unsigned long bus_writes;       /* flash write cycles, including commands */
+    unsigned long bank_switches;    /* calls to loadbank */
+    unsigned long records_read;     /* 128-byte records read from disk */
+    unsigned long records_written;  /* 128-byte records written to disk */
+    unsigned long sector_erases;
+    unsigned long chip_erases;
+    unsigned long bytes_programmed;
+    unsigned long irq_windows;      /* interrupts let in part way through a block operation */
+    unsigned long bios_copies;      /* block copies done by the BIOS inter-bank copy */
+    unsigned long kernel_tstates;   /* modelled time in the bankswitch.s inner loops */
+} sim_stats_t;
+
+extern sim_stats_t sim_stats;
+
+void sim_load(void);
+void sim_save(void);
+void sim_report(void);
+
+#endif
@@ -32,20 +32,35 @@ typedef struct cpm_fcb {
     unsigned char r2;       /* random access record number (high byte) */
 } cpm_fcb;
 
-void cpm_abort(void) CALLING;
+/* date and time as kept by CP/M 3 */
+typedef struct cpm_dat {
+    unsigned int day;       /* days since 31 December 1977 */
+    unsigned char hour;     /* BCD */
+    unsigned char minute;   /* BCD */
+} cpm_dat;
+
+/* console output, buffered in putchar.c; see console_flush() */
+#define CONSOLE_BUFFER_SIZE 128
+void console_flush(void);                                     /* (note: C) write out any buffered console output */
+void cpm_c_write(char c) CALLING;                             /* write one character to the console */
+void cpm_c_write_string(const char *text) CALLING;            /* write text up to a '$' to the console */
+
+void cpm_abort(void) CALLING;                                 /* flushes the console, then exits */
+unsigned int cpm_get_version(void) CALLING;                   /* 0x22 for CP/M 2.2, 0x31 for CP/M 3 */
+unsigned char cpm_t_get(cpm_dat *dat) CALLING;                /* CP/M 3 only: read the clock, return seconds (BCD) */
 void cpm_f_prepare(cpm_fcb *fcb, const char *name);                 /* (note: C) set filename in FCB, etc */
 int cpm_f_delete(cpm_fcb *fcb) CALLING;                       /* delete a file */
 int cpm_f_open(cpm_fcb *fcb) CALLING;                         /* open a file */
 int cpm_f_create(cpm_fcb *fcb) CALLING;                       /* create a file */
 int cpm_f_close(cpm_fcb *fcb) CALLING;                        /* close a file */
-unsigned int cpm_f_getsize(cpm_fcb *fcb) CALLING;             /* return file size, in 128-byte blocks */
+unsigned long cpm_f_getsize(cpm_fcb *fcb) CALLING;            /* return file size, in 128-byte blocks (24 bits) */
 
 /* sequential block I/O */
 unsigned char cpm_f_read_next(cpm_fcb *fcb, char *buffer) CALLING;      /* read the next 128-byte block from file */
 unsigned char cpm_f_write_next(cpm_fcb *fcb, char *buffer) CALLING;     /* write the next 128-byte block to file */
 
-/* random block I/O */
-unsigned char cpm_f_read_random(cpm_fcb *fcb, unsigned int block, char *buffer) CALLING;    /* read 128-byte block from file */
-unsigned char cpm_f_write_random(cpm_fcb *fcb, unsigned int block, char *buffer) CALLING;   /* write 128-byte block to file */
+/* random block I/O; block numbers use r0, r1 and r2 (CP/M 2.2 allows up to 65535, CP/M 3 up to 262143) */
+unsigned char cpm_f_read_random(cpm_fcb *fcb, unsigned long block, void *buffer) CALLING;   /* read 128-byte block from file */
+unsigned char cpm_f_write_random(cpm_fcb *fcb, unsigned long block, void *buffer) CALLING;  /* write 128-byte block to file */
 
 #endif
@@ -10,13 +10,55 @@
     .globl _cpm_f_write_random
     .globl _cpm_f_getsize
     .globl _cpm_abort
+    .globl _cpm_get_version
+    .globl _cpm_t_get
+    .globl _cpm_c_write
+    .globl _cpm_c_write_string
+    .globl _console_flush
 
     .area _CODE
 
 _cpm_abort:
+    call _console_flush     ; write out what putchar() has buffered
     ld c, #0
     jp 5
 
+_cpm_c_write:
+    ld hl, #2
+    add hl, sp
+    ld e, (hl)              ; character (argument)
+    ld c, #0x02             ; Function 2, Console output
+    jp 5
+
+_cpm_c_write_string:
+    pop hl                  ; return address
+    pop de                  ; text (argument)
+    ; put the stack back
+    push de
+    push hl
+
+    ld c, #0x09             ; Function 9, Print string (up to '$')
+    jp 5
+
+_cpm_get_version:
+    ld c, #0x0C             ; Function 12, Return version number
+    jp 5                    ; version in HL
+
+_cpm_t_get:
+    pop hl                  ; return address
+    pop de                  ; date and time buffer (argument)
+    ; put the stack back
+    push de
+    push hl
+
+    ld c, #0x69             ; Function 105, Get date and time (CP/M 3)
+    call 5
+
+    ; return seconds (BCD)
+    ld h, #0
+    ld l, a
+    ret
+
 _cpm_f_create:
     ld c, #0x16             ; Function 22, Make File
     jr gocpm
@@ -64,11 +106,15 @@ _cpm_f_getsize:
     ld hl, #33              ; random offset is at offset 33, 34, 35 in FCB
     add hl, de
 
-    ld e, (hl)              ; load size (in 128-byte blocks) into DE
+    ld c, (hl)              ; load size (in 128-byte blocks) into EBC
+    inc hl
+    ld b, (hl)
     inc hl
-    ld d, (hl)
+    ld e, (hl)
+    ld d, #0
 
-    ex de, hl               ; return value in HL
+    ld l, c                 ; return 32-bit value in DEHL
+    ld h, b
 
     ret
 
@@ -127,13 +173,13 @@ _cpm_f_read_random:
     push ix
     ld ix, #0
     add ix, sp
-    ; stack has: ix, return address, fcb,  block, buffer
-    ;                                ix+4  ix+6   ix+8
+    ; stack has: ix, return address, fcb,  block (32 bits), buffer
+    ;                                ix+4  ix+6             ix+10
 
     ; set the CP/M DMA address to our buffer
     ld c, #0x1A             ; Function 26, Set DMA address
-    ld e, 8(ix)
-    ld d, 9(ix)
+    ld e, 10(ix)
+    ld d, 11(ix)
     call 5
 
     ; load FCB address into DE
@@ -148,6 +194,9 @@ _cpm_f_read_random:
     inc hl
     ld a, 7(ix)
     ld (hl), a
+    inc hl
+    ld a, 8(ix)             ; r2: records 65536 and up
+    ld (hl), a
 
     ld c, #0x21             ; Function 33, Read random
     call 5
@@ -163,13 +212,13 @@ _cpm_f_write_random:
     push ix
     ld ix, #0
     add ix, sp
-    ; stack has: ix, return address, fcb,  block, buffer
-    ;                                ix+4  ix+6   ix+8
+    ; stack has: ix, return address, fcb,  block (32 bits), buffer
+    ;                                ix+4  ix+6             ix+10
 
     ; set the CP/M DMA address to our buffer
     ld c, #0x1A             ; Function 26, Set DMA address
-    ld e, 8(ix)
-    ld d, 9(ix)
+    ld e, 10(ix)
+    ld d, 11(ix)
     call 5
 
     ; load FCB address into DE
@@ -184,6 +233,9 @@ _cpm_f_write_random:
     inc hl
     ld a, 7(ix)
     ld (hl), a
+    inc hl
+    ld a, 8(ix)             ; r2: records 65536 and up
+    ld (hl), a
 
     ld c, #0x22             ; Function 34, Write random
     call 5
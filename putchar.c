@@ -1,57 +1,38 @@
-#include "calling.h"
+#include "libcpm.h"
 
-int putchar(int c)
-{
-#ifdef REGISTER_CALLING
-__asm
-; putchar routine for CP/M -- sdcccall(1) version
-    ; char to print is in L
-    push hl
+/* Console output is collected in console_buffer and written out a line at a
+ * time with BDOS function 9, rather than with a BDOS call per character,
+ * which costs a good deal on a slow serial console. Anything left over is
+ * written by console_flush(), which progress reports call so that a line
+ * ending in CR is seen straight away, and which runs before the program
+ * exits. */
+static char console_buffer[CONSOLE_BUFFER_SIZE + 1]; /* room for the '$' terminator */
+static unsigned char console_length = 0;
 
-    ; print char
-    ld e,l
-    ld c,#2
-    call 5
-
-    ; check for CR
-    pop hl
-    ld a, l
-    cp #10
-    ret nz      ; return if not CR
+void console_flush(void)
+{
+    char *start, *p;
 
-    ; after CR always print LF
-    ld e, #13
-    ld c, #2
-    jp 5        ; leave our return address on the stack
-__endasm;
-#else
-__asm
-; putchar routine for CP/M -- sdcccall(0) version
-    ; char to print is in (SP+2)
-    ld hl,#2
-    add hl,sp
-    push hl
+    console_buffer[console_length] = '$';
+    for(start = console_buffer; ; start = p + 1){
+        for(p = start; *p != '$'; p++);
+        if(p != start)
+            cpm_c_write_string(start); /* up to the '$' */
+        if(p == console_buffer + console_length)
+            break;
+        cpm_c_write('$'); /* function 9 cannot print a '$' itself */
+    }
+    console_length = 0;
+}
 
-    ; print char
-    ld e,(hl)
-    ld c,#2
-    call 5
+int putchar(int c)
+{
+    console_buffer[console_length++] = c;
+    if(c == '\n')
+        console_buffer[console_length++] = '\r'; /* after LF always print CR */
 
-    ; check for CR
-    pop hl
-    ld a, (hl)
-    cp #10
-    ret nz      ; return if not CR
+    if(c == '\n' || console_length >= CONSOLE_BUFFER_SIZE - 1)
+        console_flush();
 
-    ; after CR always print LF
-    ld e, #13
-    ld c, #2
-    jp 5        ; leave our return address on the stack
-__endasm;
-#endif
-    /* this code is compiled but never used.
-     * it exists to squelch compiler warnings.
-     */
-    c;
-    return 0;
+    return c;
 }
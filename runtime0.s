@@ -3,6 +3,7 @@
 
         .module runtime0
         .globl _main
+        .globl _console_flush
         .globl l__INITIALIZER
         .globl s__INITIALIZED
         .globl s__INITIALIZER
@@ -74,7 +75,8 @@ endcmdline:
         ; Call the C main() routine
         call _main
     
-        ; Terminate after main() returns
+        ; Terminate after main() returns, writing out any buffered output
+        call _console_flush
         ld  c, #0
         call 5
 
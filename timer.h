@@ -0,0 +1,61 @@
+#ifndef __TIMER_DOT_H__
+#define __TIMER_DOT_H__
+
+#include <stdbool.h>
+#include "calling.h"
+
+/* The timebase gives us the CPU clock, so that delays last as long as they
+   should on any CPU, and a clock to time operations against, where the
+   system has one. */
+
+/* BIOS to ask, passed to timer_init() */
+#define TIMER_BIOS_NONE         0
+#define TIMER_BIOS_ROMWBW       1 /* RomWBW v2.6 and later (HBIOS) */
+#define TIMER_BIOS_UNA          2
+
+/* where timer_cpu_khz came from */
+#define TIMER_SPEED_ASSUMED     0
+#define TIMER_SPEED_HBIOS       1 /* SYSGET CPUINFO */
+#define TIMER_SPEED_UNA         2 /* UNA BIOS get PHI */
+#define TIMER_SPEED_Z180_PRT    3 /* reload value of the Z180 PRT0 system tick */
+#define TIMER_SPEED_CALIBRATED  4 /* timed against the clock */
+
+/* the clock behind timer_elapsed_ms() */
+#define TIMER_CLOCK_NONE        0
+#define TIMER_CLOCK_HBIOS       1 /* HBIOS system tick, usually 50Hz */
+#define TIMER_CLOCK_CPM3        2 /* CP/M 3 date and time, to the second */
+
+#define TIMER_DEFAULT_KHZ   40000 /* assumed when the CPU clock is unknown; delays run long on slower CPUs */
+#define TIMER_SPIN_TSTATES_Z80 26 /* T-states per timer_spin() loop */
+#define TIMER_SPIN_TSTATES_Z180 20
+#define TIMER_POLL_TSTATES    400 /* fewest T-states a timeout poll can take, used without a clock */
+
+/* a timeout in progress; see timer_timeout_start() */
+typedef struct {
+    unsigned long start;      /* timer_elapsed_ms() at the start */
+    unsigned long ms;         /* length of the timeout */
+    unsigned long polls;      /* calls to timer_timeout_expired() so far */
+    unsigned long poll_limit; /* polls the timeout lasts, by the CPU clock */
+} timer_timeout_t;
+
+void timer_init(unsigned char bios, bool z180);
+unsigned long timer_elapsed_ms(void);       /* milliseconds since timer_init(), always 0 without a clock */
+void timer_delay_ms(unsigned int ms);       /* busy wait for at least this long */
+void timer_timeout_start(timer_timeout_t *timeout, unsigned long ms);
+bool timer_timeout_expired(timer_timeout_t *timeout); /* call once for each poll */
+void timer_report(void);                    /* describe the timebase in use */
+
+extern unsigned int timer_cpu_khz;
+extern unsigned char timer_speed_source;
+extern unsigned char timer_clock;
+
+/* assembler helpers in timer.s; the BIOS functions must only be called when
+   that BIOS is present */
+unsigned int timer_hbios_cpu_khz(void) CALLING;   /* 0 on error */
+unsigned long timer_hbios_ticks(void) CALLING;
+unsigned char timer_hbios_tick_rate(void) CALLING; /* ticks per second, 0 if not reported */
+unsigned long timer_una_cpu_hz(void) CALLING;     /* 0 on error */
+unsigned int timer_z180_prt0_reload(void) CALLING; /* 0 unless PRT0 is running with interrupts */
+void timer_spin(unsigned int loops) CALLING;
+
+#endif
@@ -0,0 +1,84 @@
+    .module timer
+    .hd64
+
+    .globl _timer_hbios_cpu_khz
+    .globl _timer_hbios_ticks
+    .globl _timer_hbios_tick_rate
+    .globl _timer_una_cpu_hz
+    .globl _timer_z180_prt0_reload
+    .globl _timer_spin
+
+; RomWBW HBIOS system information
+ROMWBW_TIMER       .equ 0xF8D0  ; SYSGET TIMER: DE:HL = ticks, C = ticks per second
+ROMWBW_CPUINFO     .equ 0xF8F0  ; SYSGET CPUINFO: DE = CPU clock in kHz
+
+; UNA BIOS
+UNABIOS_GETPHI     .equ 0xF8    ; C register - DE:HL = CPU clock (PHI) in Hz
+
+; Z180 programmable reload timer 0, which the BIOS runs as its system tick;
+; the internal I/O registers are at 0x40 as for the DMA engine (z180dma.s)
+Z180_RLDR0L        .equ 0x4E
+Z180_RLDR0H        .equ 0x4F
+Z180_TCR           .equ 0x50
+Z180_TCR_RUN0      .equ 0x11    ; TIE0 and TDE0: timer 0 counting with interrupts
+
+    .area _CODE
+
+_timer_hbios_cpu_khz:
+    ld bc, #ROMWBW_CPUINFO
+    rst 8               ; call into RomWBW
+    or a                ; A=0?
+    jr nz, retzero      ; something went wrong
+    ex de, hl           ; return kHz in HL
+    ret
+
+_timer_hbios_ticks:
+    ld bc, #ROMWBW_TIMER
+    rst 8               ; call into RomWBW; returns the count in DE:HL
+    ret
+
+_timer_hbios_tick_rate:
+    ld bc, #ROMWBW_TIMER
+    rst 8               ; call into RomWBW
+    or a                ; A=0?
+    jr nz, retzero      ; something went wrong
+    ld h, #0
+    ld l, c             ; return ticks per second in HL
+    ret
+
+_timer_una_cpu_hz:
+    ld c, #UNABIOS_GETPHI
+    rst 8               ; call into UNA; returns Hz in DE:HL
+    ret
+
+_timer_z180_prt0_reload:
+    in0 a, (Z180_TCR)
+    and #Z180_TCR_RUN0
+    cp #Z180_TCR_RUN0
+    jr nz, retzero      ; not the system tick
+    in0 l, (Z180_RLDR0L)
+    in0 h, (Z180_RLDR0H)
+    ret
+
+retzero:
+    ld hl, #0
+    ld d, h
+    ld e, l
+    ret
+
+    ; busy loop, 26 T-states per loop on the Z80 and 20 on the Z180
+_timer_spin:
+    pop hl              ; return address
+    pop bc              ; loops (argument)
+    ; put the stack back
+    push bc
+    push hl
+    ld a, b
+    or c
+    ret z
+spin:
+    dec bc
+    ld a, b
+    or c
+    jr nz, spin
+    ret
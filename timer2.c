@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include "libcpm.h"
+#include "detectcpu.h"
+#include "timer.h"
+
+#define TIMER_CALIBRATE_MS      100 /* calibrate the delay loop over at least this long */
+#define TIMER_CALIBRATE_CHUNK  1000 /* timer_spin() loops between readings of the clock */
+#define TIMER_TICK_WAIT         200 /* chunks to wait for an HBIOS tick before deciding the clock has stopped */
+#define TIMER_SECOND_WAIT      1500 /* chunks to wait for the CP/M 3 clock to tick over */
+#define TIMER_HBIOS_TICK_RATE    50 /* what RomWBW programs the system tick for */
+#define TIMER_MIN_KHZ          1000 /* CPU clock figures from the BIOS outside this range are ignored */
+#define TIMER_MAX_KHZ         65000
+
+unsigned int timer_cpu_khz = TIMER_DEFAULT_KHZ;
+unsigned char timer_speed_source = TIMER_SPEED_ASSUMED;
+unsigned char timer_clock = TIMER_CLOCK_NONE;
+
+static unsigned char spin_tstates = TIMER_SPIN_TSTATES_Z80;
+static unsigned int spin_per_ms;    /* timer_spin() loops per millisecond */
+static unsigned char tick_rate;     /* HBIOS ticks per second */
+static unsigned int start_day;      /* CP/M 3 day number at timer_init() */
+static unsigned long clock_start;   /* clock_read() at timer_init() */
+
+static unsigned char bcd(unsigned char value)
+{
+    return (value >> 4) * 10 + (value & 0x0F);
+}
+
+/* milliseconds since some arbitrary time */
+static unsigned long clock_read(void)
+{
+    cpm_dat dat;
+    unsigned long ticks;
+    unsigned char seconds;
+
+    switch(timer_clock){
+        case TIMER_CLOCK_HBIOS:
+            ticks = timer_hbios_ticks();
+            return (ticks / tick_rate) * 1000 + (ticks % tick_rate) * 1000 / tick_rate;
+        case TIMER_CLOCK_CPM3:
+            seconds = cpm_t_get(&dat);
+            return ((((unsigned long)(dat.day - start_day) * 24 + bcd(dat.hour)) * 60 +
+                        bcd(dat.minute)) * 60 + bcd(seconds)) * 1000;
+        default:
+            return 0;
+    }
+}
+
+/* wait for the clock to move on, so that we are at the start of a tick;
+   false if it has not moved after the given number of chunks */
+static bool clock_running(unsigned int chunks)
+{
+    unsigned long start;
+
+    start = clock_read();
+    while(clock_read() == start){
+        if(!chunks--)
+            return false;
+        timer_spin(TIMER_CALIBRATE_CHUNK);
+    }
+
+    return true;
+}
+
+/* count the delay loops in a known time; call at the start of a tick */
+static void clock_calibrate(void)
+{
+    unsigned long start, now, loops = 0;
+
+    /* the time taken to read the clock makes us count too few loops and so
+       err towards longer delays */
+    start = clock_read();
+    do{
+        timer_spin(TIMER_CALIBRATE_CHUNK);
+        loops += TIMER_CALIBRATE_CHUNK;
+        now = clock_read();
+    }while(now - start < TIMER_CALIBRATE_MS);
+
+    spin_per_ms = loops / (now - start) + 1;
+    loops = (unsigned long)spin_per_ms * spin_tstates;
+    timer_cpu_khz = loops > TIMER_MAX_KHZ ? TIMER_MAX_KHZ : loops;
+    timer_speed_source = TIMER_SPEED_CALIBRATED;
+}
+
+static bool timer_speed_plausible(unsigned long khz)
+{
+    if(khz < TIMER_MIN_KHZ || khz > TIMER_MAX_KHZ)
+        return false;
+    timer_cpu_khz = khz;
+    return true;
+}
+
+void timer_init(unsigned char bios, bool z180_prt)
+{
+    cpm_dat dat;
+    unsigned int reload;
+
+    if(detect_z180_cpu())
+        spin_tstates = TIMER_SPIN_TSTATES_Z180;
+
+    /* find a clock */
+    if(bios == TIMER_BIOS_ROMWBW && (tick_rate = timer_hbios_tick_rate()) != 0)
+        timer_clock = TIMER_CLOCK_HBIOS;
+    else if((cpm_get_version() & 0xFF) >= 0x30){
+        cpm_t_get(&dat);
+        start_day = dat.day;
+        timer_clock = TIMER_CLOCK_CPM3;
+    }
+
+    /* ask the BIOS or the hardware for the CPU clock */
+    if(bios == TIMER_BIOS_ROMWBW && timer_speed_plausible(timer_hbios_cpu_khz()))
+        timer_speed_source = TIMER_SPEED_HBIOS;
+    else if(bios == TIMER_BIOS_UNA && timer_speed_plausible(timer_una_cpu_hz() / 1000))
+        timer_speed_source = TIMER_SPEED_UNA;
+    else if(z180_prt && (reload = timer_z180_prt0_reload()) != 0 &&
+            timer_speed_plausible((unsigned long)(reload + 1) * 20 *
+                (timer_clock == TIMER_CLOCK_HBIOS ? tick_rate : TIMER_HBIOS_TICK_RATE) / 1000))
+        timer_speed_source = TIMER_SPEED_Z180_PRT; /* PRT0 counts at PHI/20 */
+    spin_per_ms = timer_cpu_khz / spin_tstates + 1;
+
+    /* The HBIOS tick only moves when interrupts are enabled, so check it
+       before we rely on it. Failing all else we time the delay loop against
+       the clock, which takes a second with the CP/M 3 clock. */
+    if(timer_clock == TIMER_CLOCK_HBIOS){
+        if(!clock_running(TIMER_TICK_WAIT))
+            timer_clock = TIMER_CLOCK_NONE;
+        else if(timer_speed_source == TIMER_SPEED_ASSUMED)
+            clock_calibrate();
+    }else if(timer_clock == TIMER_CLOCK_CPM3 && timer_speed_source == TIMER_SPEED_ASSUMED){
+        if(clock_running(TIMER_SECOND_WAIT))
+            clock_calibrate();
+        else
+            timer_clock = TIMER_CLOCK_NONE;
+    }
+
+    clock_start = clock_read();
+}
+
+unsigned long timer_elapsed_ms(void)
+{
+    return clock_read() - clock_start;
+}
+
+void timer_delay_ms(unsigned int ms)
+{
+    while(ms--)
+        timer_spin(spin_per_ms);
+}
+
+void timer_timeout_start(timer_timeout_t *timeout, unsigned long ms)
+{
+    timeout->start = timer_elapsed_ms();
+    timeout->ms = ms;
+    timeout->polls = 0;
+    timeout->poll_limit = ms * (timer_cpu_khz / TIMER_POLL_TSTATES + 1);
+}
+
+bool timer_timeout_expired(timer_timeout_t *timeout)
+{
+    timeout->polls++;
+    if(timer_clock == TIMER_CLOCK_NONE)
+        return timeout->polls > timeout->poll_limit;
+
+    /* reading the clock may mean a BIOS call, so we do not read it every
+       time; a generous poll count still applies in case the clock stops */
+    if((timeout->polls & 0x3F) == 0 && timer_elapsed_ms() - timeout->start > timeout->ms)
+        return true;
+    return timeout->polls > timeout->poll_limit * 4;
+}
+
+void timer_report(void)
+{
+    static const char * const speed_sources[] = { "assumed", "from HBIOS", "from UNA BIOS", "from Z180 PRT0", "calibrated" };
+    static const char * const clocks[] = { "no clock", "HBIOS tick", "CP/M 3 clock" };
+
+    printf("CPU clock %u.%03uMHz (%s), timing against %s\n",
+            timer_cpu_khz / 1000, timer_cpu_khz % 1000,
+            speed_sources[timer_speed_source], clocks[timer_clock]);
+}
@@ -0,0 +1,45 @@
+#ifndef __XMODEM_DOT_H__
+#define __XMODEM_DOT_H__
+
+#include <stdbool.h>
+#include "calling.h"
+
+/* XMODEM, XMODEM-1K and YMODEM (single file) transfers through the console
+   or a RomWBW HBIOS character unit, so that an image can go straight
+   between the flash and another computer without passing through a CP/M
+   file. Receiving accepts whatever the sender offers: 128 or 1024 byte
+   packets, CRC or checksum, with or without a YMODEM header. Sending uses
+   1024 byte packets when the receiver asks for CRC mode.
+
+   The receiver only acknowledges a packet when the next one is wanted, so
+   a caller which stops calling xmodem_receive() (to erase a sector, say)
+   holds the sender off until it is ready for more. */
+
+#define XMODEM_CONSOLE      0xFF /* xmodem_unit: the CP/M console, through the BIOS */
+#define XMODEM_NAME_LENGTH    12 /* YMODEM file name we keep */
+
+extern unsigned char xmodem_unit;       /* HBIOS character unit, or XMODEM_CONSOLE */
+extern unsigned long xmodem_size;       /* received: size from the YMODEM header, 0 if not known */
+extern char xmodem_name[XMODEM_NAME_LENGTH + 1]; /* received: name from the YMODEM header */
+extern const char *xmodem_error;        /* why the last call failed, NULL if it did not */
+
+bool xmodem_receive_start(void);        /* wait for the sender and read the YMODEM header, if any */
+/* fill buffer with the next bytes of the file; returns fewer than length at the end */
+unsigned int xmodem_receive(unsigned char *buffer, unsigned int length);
+bool xmodem_receive_end(void);          /* finish the transfer; false if the file held more data */
+
+bool xmodem_send_start(const char *name, unsigned long size, bool ymodem); /* wait for the receiver */
+bool xmodem_send(unsigned char *buffer, unsigned int length); /* length is a multiple of 128 */
+bool xmodem_send_end(void);
+
+void xmodem_cancel(void);               /* abandon a transfer in progress */
+
+/* character I/O helpers in xmodem.s; the HBIOS functions need RomWBW v2.6 or later */
+unsigned char serial_bios_status(void) CALLING; /* 0xFF if console input is waiting (BIOS CONST), else 0 */
+unsigned char serial_bios_in(void) CALLING;
+void serial_bios_out(unsigned char c) CALLING;
+unsigned char serial_hbios_status(unsigned char unit) CALLING; /* characters waiting */
+unsigned char serial_hbios_in(unsigned char unit) CALLING;
+void serial_hbios_out(unsigned char unit, unsigned char c) CALLING;
+
+#endif
@@ -0,0 +1,75 @@
+    .module xmodem
+
+    .globl _serial_bios_status
+    .globl _serial_bios_in
+    .globl _serial_bios_out
+    .globl _serial_hbios_status
+    .globl _serial_hbios_in
+    .globl _serial_hbios_out
+
+; CP/M BIOS console entry points, as offsets from the warm boot entry
+; whose address is at BIOS_ENTRY_ADDR (libcpm.h)
+BIOS_ENTRY         .equ 0x0001
+BIOS_CONST         .equ 3       ; A = 0xFF if a character is waiting
+BIOS_CONIN         .equ 6       ; A = character
+BIOS_CONOUT        .equ 9       ; C = character
+
+; RomWBW HBIOS character I/O: B register, with C = unit
+ROMWBW_CIOIN       .equ 0x00    ; E = character
+ROMWBW_CIOOUT      .equ 0x01    ; E = character
+ROMWBW_CIOIST      .equ 0x02    ; A = characters waiting
+
+    .area _CODE
+
+_serial_bios_status:
+    ld de, #BIOS_CONST
+    jr bios_call
+
+_serial_bios_in:
+    ld de, #BIOS_CONIN
+    jr bios_call
+
+_serial_bios_out:
+    ld hl, #2
+    add hl, sp
+    ld c, (hl)          ; character (argument)
+    ld de, #BIOS_CONOUT
+bios_call:
+    push ix             ; not every BIOS preserves IX
+    ld hl, (BIOS_ENTRY)
+    add hl, de
+    call jphl
+    pop ix
+    ld h, #0
+    ld l, a             ; return A
+    ret
+
+jphl:
+    jp (hl)
+
+_serial_hbios_status:
+    ld b, #ROMWBW_CIOIST
+    call hbios_call
+    ld l, a             ; return characters waiting
+    ret
+
+_serial_hbios_in:
+    ld b, #ROMWBW_CIOIN
+    call hbios_call
+    ld l, e             ; return character
+    ret
+
+_serial_hbios_out:
+    ld b, #ROMWBW_CIOOUT
+    call hbios_call
+    ret
+
+hbios_call:
+    ld hl, #4           ; skip our return address and the caller's
+    add hl, sp
+    ld c, (hl)          ; unit (argument)
+    inc hl
+    ld e, (hl)          ; character (serial_hbios_out only)
+    rst 8               ; call into RomWBW
+    ld h, #0
+    ret
@@ -0,0 +1,437 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include "buffers.h"
+#include "timer.h"
+#include "xmodem.h"
+
+#define SOH             0x01 /* 128 byte packet follows */
+#define STX             0x02 /* 1024 byte packet follows */
+#define EOT             0x04 /* end of file */
+#define ACK             0x06
+#define NAK             0x15
+#define CAN             0x18 /* two in a row cancel the transfer */
+#define CRC_REQUEST      'C' /* receiver wants CRC mode, and takes 1024 byte packets */
+#define PAD_CHAR        0x1A /* fills the last packet of an XMODEM file */
+#define SHORT_PACKET     128
+
+#define XMODEM_START_MS      3000 /* between our requests for the sender to start */
+#define XMODEM_START_TRIES     20 /* about a minute for the other end to start... */
+#define XMODEM_CRC_TRIES       10 /* ...asking for CRC mode for the first half of it */
+#define XMODEM_PACKET_MS    10000 /* wait for a packet, or for its acknowledgement */
+#define XMODEM_CHAR_MS       1000 /* between the characters of a packet */
+#define XMODEM_PURGE_MS       500 /* the line is quiet once a bad packet is over */
+#define XMODEM_RETRIES         10 /* bad packets in a row before we give up */
+#define XMODEM_CANCEL_COUNT     8 /* CAN characters we send to cancel */
+
+/* receive_packet() results */
+#define PACKET_DATA     0
+#define PACKET_EOT      1
+#define PACKET_CANCEL   2
+#define PACKET_BAD      3 /* timed out or garbled */
+
+unsigned char xmodem_unit = XMODEM_CONSOLE;
+unsigned long xmodem_size;
+char xmodem_name[XMODEM_NAME_LENGTH + 1];
+const char *xmodem_error;
+
+static bool crc_mode;
+static bool batch;                  /* YMODEM */
+static unsigned char block;         /* receiving: the packet we want next; sending: the packet we send next */
+static unsigned char packet_block;  /* block number of the packet just received */
+static unsigned int packet_size;    /* length of the packet just received */
+static unsigned int packet_length;  /* data held in packetbuffer */
+static unsigned int packet_used;    /* data from packetbuffer already passed on */
+static unsigned char response;      /* what we send to ask for the next packet */
+static bool file_end;               /* the sender has sent EOT */
+static unsigned long received;      /* bytes passed on by xmodem_receive() */
+
+/* CRC-16/XMODEM, a byte at a time */
+static unsigned int crc_update(unsigned int crc, unsigned char data)
+{
+    crc = ((crc >> 8) | (crc << 8)) & 0xFFFF;
+    crc ^= data;
+    crc ^= (crc & 0xFF) >> 4;
+    crc ^= crc << 12;
+    crc ^= (crc & 0xFF) << 5;
+    return crc & 0xFFFF;
+}
+
+static bool serial_ready(void)
+{
+    if(xmodem_unit == XMODEM_CONSOLE)
+        return serial_bios_status() != 0;
+    return serial_hbios_status(xmodem_unit) != 0;
+}
+
+static void serial_out(unsigned char c)
+{
+    if(xmodem_unit == XMODEM_CONSOLE)
+        serial_bios_out(c);
+    else
+        serial_hbios_out(xmodem_unit, c);
+}
+
+/* the next character from the line, or -1 if none arrives in time */
+static int serial_in(unsigned int ms)
+{
+    timer_timeout_t timeout;
+
+    /* while a packet is arriving the next character is usually there already,
+       so we only start the clock when we have to wait */
+    if(!serial_ready()){
+        timer_timeout_start(&timeout, ms);
+        while(!serial_ready())
+            if(timer_timeout_expired(&timeout))
+                return -1;
+    }
+
+    if(xmodem_unit == XMODEM_CONSOLE)
+        return serial_bios_in();
+    return serial_hbios_in(xmodem_unit);
+}
+
+/* discard the rest of a bad packet */
+static void serial_purge(void)
+{
+    while(serial_in(XMODEM_PURGE_MS) >= 0);
+}
+
+static bool fail(const char *reason)
+{
+    xmodem_error = reason;
+    return false;
+}
+
+void xmodem_cancel(void)
+{
+    unsigned char i;
+
+    for(i=0; i<XMODEM_CANCEL_COUNT; i++)
+        serial_out(CAN);
+}
+
+static bool cancel(const char *reason)
+{
+    xmodem_cancel();
+    return fail(reason);
+}
+
+/* read a packet into packetbuffer */
+static unsigned char receive_packet(unsigned int ms)
+{
+    int c;
+    unsigned int i, crc = 0;
+    unsigned char sum = 0;
+
+    switch(serial_in(ms)){
+        case SOH:
+            packet_size = SHORT_PACKET;
+            break;
+        case STX:
+            packet_size = PACKETBUFFER_SIZE;
+            break;
+        case EOT:
+            return PACKET_EOT;
+        case CAN:
+            return serial_in(XMODEM_CHAR_MS) == CAN ? PACKET_CANCEL : PACKET_BAD;
+        default:
+            return PACKET_BAD;
+    }
+
+    if((c = serial_in(XMODEM_CHAR_MS)) < 0)
+        return PACKET_BAD;
+    packet_block = c;
+    if((c = serial_in(XMODEM_CHAR_MS)) < 0 || (unsigned char)c != (unsigned char)~packet_block)
+        return PACKET_BAD;
+
+    for(i=0; i<packet_size; i++){
+        if((c = serial_in(XMODEM_CHAR_MS)) < 0)
+            return PACKET_BAD;
+        packetbuffer[i] = c;
+        crc = crc_update(crc, c);
+        sum += c;
+    }
+
+    if(crc_mode){
+        if((c = serial_in(XMODEM_CHAR_MS)) < 0 || c != (crc >> 8))
+            return PACKET_BAD;
+        if((c = serial_in(XMODEM_CHAR_MS)) < 0 || c != (crc & 0xFF))
+            return PACKET_BAD;
+    }else if((c = serial_in(XMODEM_CHAR_MS)) < 0 || c != sum)
+        return PACKET_BAD;
+
+    return PACKET_DATA;
+}
+
+/* the sender has sent EOT: acknowledge it, and with YMODEM take the empty
+   header that ends the batch */
+static void end_of_file(void)
+{
+    file_end = true;
+    packet_length = packet_used = 0;
+
+    if(batch){
+        serial_out(NAK); /* the EOT is sent twice */
+        receive_packet(XMODEM_PACKET_MS);
+        serial_out(ACK);
+        serial_out(CRC_REQUEST);
+        crc_mode = true;
+        if(receive_packet(XMODEM_PACKET_MS) == PACKET_DATA && packet_block == 0){
+            if(packetbuffer[0])
+                xmodem_cancel(); /* another file: we take only the one */
+            else
+                serial_out(ACK);
+        }
+    }else
+        serial_out(ACK);
+}
+
+/* acknowledge what we have and fetch the next packet of the file; false
+   at the end of the file or on error */
+static bool next_packet(void)
+{
+    unsigned char errors = 0;
+
+    packet_length = packet_used = 0;
+
+    while(errors < XMODEM_RETRIES){
+        serial_out(response);
+        switch(receive_packet(XMODEM_PACKET_MS)){
+            case PACKET_DATA:
+                response = ACK;
+                if(packet_block == block){
+                    block++;
+                    packet_length = packet_size;
+                    return true;
+                }
+                if(packet_block == (unsigned char)(block - 1))
+                    break; /* our acknowledgement was lost, so we have this one already */
+                return cancel("Transfer packets arrived out of order.");
+            case PACKET_EOT:
+                end_of_file();
+                return false;
+            case PACKET_CANCEL:
+                return fail("Transfer cancelled by the sender.");
+            default:
+                serial_purge();
+                response = NAK;
+                errors++;
+                break;
+        }
+    }
+
+    return cancel("Transfer failed: too many errors.");
+}
+
+bool xmodem_receive_start(void)
+{
+    unsigned char tries, result;
+    char *field;
+
+    xmodem_error = NULL;
+    xmodem_size = 0;
+    xmodem_name[0] = 0;
+    batch = false;
+    file_end = false;
+    received = 0;
+    packet_length = packet_used = 0;
+
+    /* ask for CRC mode, falling back on checksums for an older sender */
+    for(tries=0; ; tries++){
+        if(tries == XMODEM_START_TRIES)
+            return cancel("Transfer did not start.");
+        crc_mode = tries < XMODEM_CRC_TRIES;
+        serial_out(crc_mode ? CRC_REQUEST : NAK);
+        result = receive_packet(XMODEM_START_MS);
+        if(result == PACKET_DATA)
+            break;
+        if(result == PACKET_CANCEL)
+            return fail("Transfer cancelled by the sender.");
+        if(result == PACKET_EOT){
+            serial_out(ACK);
+            return fail("Transfer ended before it began.");
+        }
+    }
+
+    if(packet_block == 0){
+        /* YMODEM header: the file name, a NUL, then the size in decimal */
+        batch = true;
+        serial_out(ACK);
+        if(!packetbuffer[0])
+            return fail("Transfer has no file in it.");
+        packetbuffer[packet_size - 1] = 0;
+        strncpy(xmodem_name, (char*)packetbuffer, XMODEM_NAME_LENGTH);
+        xmodem_name[XMODEM_NAME_LENGTH] = 0;
+        for(field = (char*)packetbuffer + strlen((char*)packetbuffer) + 1; *field >= '0' && *field <= '9'; field++)
+            xmodem_size = xmodem_size * 10 + (*field - '0');
+        crc_mode = true;
+        response = CRC_REQUEST; /* now the file, please */
+        block = 1;
+        return true;
+    }
+
+    if(packet_block != 1)
+        return cancel("Transfer packets arrived out of order.");
+    response = ACK;
+    block = 2;
+    packet_length = packet_size;
+    return true;
+}
+
+unsigned int xmodem_receive(unsigned char *buffer, unsigned int length)
+{
+    unsigned int done = 0, count;
+
+    while(done < length){
+        if(packet_used == packet_length && (file_end || !next_packet()))
+            break;
+        count = packet_length - packet_used;
+        if(count > length - done)
+            count = length - done;
+        if(xmodem_size && count > xmodem_size - received)
+            count = xmodem_size - received; /* the rest is padding */
+        if(!count)
+            break;
+        memcpy(buffer + done, packetbuffer + packet_used, count);
+        packet_used += count;
+        done += count;
+        received += count;
+    }
+
+    return done;
+}
+
+/* the rest of packetbuffer is XMODEM padding */
+static bool padding(void)
+{
+    while(packet_used < packet_length)
+        if(packetbuffer[packet_used++] != PAD_CHAR)
+            return false;
+    return true;
+}
+
+bool xmodem_receive_end(void)
+{
+    while(!file_end){
+        if(xmodem_size ? received < xmodem_size : !padding())
+            return cancel("Transfer holds more data than was wanted.");
+        packet_used = packet_length;
+        if(!next_packet() && xmodem_error)
+            return false;
+    }
+
+    return true;
+}
+
+static bool send_packet(unsigned char *data, unsigned int length)
+{
+    unsigned char tries, sum = 0;
+    unsigned int i, crc = 0;
+    int c;
+
+    for(i=0; i<length; i++){
+        crc = crc_update(crc, data[i]);
+        sum += data[i];
+    }
+
+    for(tries=0; tries<XMODEM_RETRIES; tries++){
+        serial_out(length == SHORT_PACKET ? SOH : STX);
+        serial_out(block);
+        serial_out(~block);
+        for(i=0; i<length; i++)
+            serial_out(data[i]);
+        if(crc_mode){
+            serial_out(crc >> 8);
+            serial_out(crc);
+        }else
+            serial_out(sum);
+
+        /* anything but an acknowledgement means send it again */
+        c = serial_in(XMODEM_PACKET_MS);
+        if(c == ACK){
+            block++;
+            return true;
+        }
+        if(c == CAN && serial_in(XMODEM_CHAR_MS) == CAN)
+            return fail("Transfer cancelled by the receiver.");
+        serial_purge();
+    }
+
+    return cancel("Transfer failed: too many errors.");
+}
+
+bool xmodem_send_start(const char *name, unsigned long size, bool ymodem)
+{
+    unsigned char tries;
+    int c;
+
+    xmodem_error = NULL;
+    batch = ymodem;
+
+    for(tries=0; ; tries++){
+        if(tries == XMODEM_START_TRIES)
+            return cancel("Transfer did not start.");
+        c = serial_in(XMODEM_START_MS);
+        if(c == CRC_REQUEST || c == NAK)
+            break;
+        if(c == CAN && serial_in(XMODEM_CHAR_MS) == CAN)
+            return fail("Transfer cancelled by the receiver.");
+    }
+    crc_mode = (c == CRC_REQUEST);
+
+    if(batch){
+        /* YMODEM header, then the receiver asks again for the file itself */
+        memset(packetbuffer, 0, SHORT_PACKET);
+        strcpy((char*)packetbuffer, name);
+        sprintf((char*)packetbuffer + strlen(name) + 1, "%lu", size);
+        block = 0;
+        if(!send_packet(packetbuffer, SHORT_PACKET))
+            return false;
+        if(serial_in(XMODEM_PACKET_MS) != CRC_REQUEST)
+            return cancel("Transfer did not start.");
+    }
+
+    block = 1;
+    return true;
+}
+
+bool xmodem_send(unsigned char *buffer, unsigned int length)
+{
+    unsigned int size;
+
+    /* 1024 byte packets need CRC mode; checksum receivers are older */
+    while(length){
+        size = (crc_mode && length >= PACKETBUFFER_SIZE) ? PACKETBUFFER_SIZE : SHORT_PACKET;
+        if(!send_packet(buffer, size))
+            return false;
+        buffer += size;
+        length -= size;
+    }
+
+    return true;
+}
+
+bool xmodem_send_end(void)
+{
+    unsigned char tries;
+
+    /* a YMODEM receiver asks for the EOT twice */
+    for(tries=0; ; tries++){
+        if(tries == XMODEM_RETRIES)
+            return fail("Transfer end was not acknowledged.");
+        serial_out(EOT);
+        if(serial_in(XMODEM_PACKET_MS) == ACK)
+            break;
+    }
+
+    if(batch){
+        /* an empty header ends the batch */
+        serial_in(XMODEM_PACKET_MS); /* the receiver asks for the next file */
+        memset(packetbuffer, 0, SHORT_PACKET);
+        block = 0;
+        return send_packet(packetbuffer, SHORT_PACKET);
+    }
+
+    return true;
+}
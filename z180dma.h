@@ -19,5 +19,6 @@ unsigned char flashrom_chip_read_z180dma(unsigned long address) CALLING;
 void flashrom_block_read_z180dma(unsigned long address, unsigned char *buffer, unsigned int length) CALLING;
 void flashrom_block_write_z180dma(unsigned long address, unsigned char *buffer, unsigned int length) CALLING;
 bool flashrom_block_verify_z180dma(unsigned long address, unsigned char *buffer, unsigned int length) CALLING;
+bool flashrom_block_verify_constant_z180dma(unsigned long address, unsigned char value, unsigned int length) CALLING;
 
 #endif
@@ -71,6 +71,28 @@ bool flashrom_block_verify_z180dma(unsigned long address, unsigned char *buffer,
     return true;
 }
 
+bool flashrom_block_verify_constant_z180dma(unsigned long address, unsigned char value, unsigned int length) CALLING
+{
+    unsigned int bytes;
+    unsigned char *ptr;
+
+    while(length > 0){
+        if(length >= CPM_BLOCK_SIZE)
+            bytes = CPM_BLOCK_SIZE;
+        else
+            bytes = length;
+        dma_memory(flashrom_to_physical(address), virtual_to_physical(rombuffer), bytes);
+        for(ptr = rombuffer; ptr < rombuffer + bytes; ptr++)
+            if(*ptr != value)
+                return false;
+
+        address += bytes;
+        length -= bytes;
+    }
+
+    return true;
+}
+
 void flashrom_program_byte_z180dma(unsigned long address, unsigned char value) CALLING
 {
     unsigned char a, b;